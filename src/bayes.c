@@ -18,8 +18,13 @@
 /** Normal-InvWishart updating 
     Y|mu, Sigma ~ N(mu, Sigma) 
        mu|Sigma ~ N(mu0, Sigma/tau0) 
-          Sigma ~ InvWish(nu0, S0^{-1}) **/
-void NIWupdate(
+          Sigma ~ InvWish(nu0, S0^{-1}) 
+    A row of Y with weight m counts as m identical observations.
+    With a stream (see rngUnif) it draws from the stream and, instead of
+    calling error(), returns the LAPACK error code of a matrix that fails
+    to invert, so that it can run off the main thread; it returns 0
+    otherwise **/
+int NIWupdate(
 	       double **Y,         /* data */
 	       double *mu,         /* mean */
 	       double **Sigma,     /* variance */
@@ -28,21 +33,27 @@ void NIWupdate(
 	       double tau0,        /* prior scale */
 	       int nu0,            /* prior df */
 	       double **S0,        /* prior scale */
-	       int n_samp,         /* sample size */
-	       int n_dim)          /* dimension */
+	       int n_samp,         /* number of rows of Y */
+	       int n_dim,          /* dimension */
+	       double *weight,     /* integer weight of each row, NULL if all 1 */
+	       unsigned long long *stream) /* NULL for R's RNG */
 {
-  int i,j,k;
+  int i,j,k,step,errorM=0;
+  double n_eff = 0;              /* sample size: the sum of the weights */
   double *Ybar = doubleArray(n_dim);
   double *mun = doubleArray(n_dim);
   double **Sn = doubleMatrix(n_dim, n_dim);
   double **mtemp = doubleMatrix(n_dim, n_dim);
 
+  for (i=0; i<n_samp; i++)
+    n_eff += weight ? weight[i] : 1;
+
   /*read data */
   for (j=0; j<n_dim; j++) {
     Ybar[j] = 0;
     for (i=0; i<n_samp; i++)
-      Ybar[j] += Y[i][j];
-    Ybar[j] /= n_samp;
+      Ybar[j] += (weight ? weight[i] : 1)*Y[i][j];
+    Ybar[j] /= n_eff;
     for (k=0; k<n_dim; k++)
       Sn[j][k] = S0[j][k];
   }
@@ -51,27 +62,35 @@ void NIWupdate(
 
   for (j=0; j<n_dim; j++) 
     {
-      mun[j] = (tau0*mu0[j]+n_samp*Ybar[j])/(tau0+n_samp);
+      mun[j] = (tau0*mu0[j]+n_eff*Ybar[j])/(tau0+n_eff);
       for (k=0; k<n_dim; k++) 
 	{
-	  Sn[j][k] += (tau0*n_samp)*(Ybar[j]-mu0[j])*(Ybar[k]-mu0[k])/(tau0+n_samp);
+	  Sn[j][k] += (tau0*n_eff)*(Ybar[j]-mu0[j])*(Ybar[k]-mu0[k])/(tau0+n_eff);
 	  for (i=0; i<n_samp; i++)
-	    Sn[j][k] += (Y[i][j]-Ybar[j])*(Y[i][k]-Ybar[k]);
+	    Sn[j][k] += (weight ? weight[i] : 1)*(Y[i][j]-Ybar[j])*(Y[i][k]-Ybar[k]);
 	}
     }
 
-  dinv(Sn, n_dim, mtemp);
-  rWish(InvSigma, mtemp, nu0+n_samp, n_dim);
-  dinv(InvSigma, n_dim, Sigma);
+  if (stream == NULL) {
+    dinv(Sn, n_dim, mtemp);
+    rWish(InvSigma, mtemp, nu0+(int)n_eff, n_dim);
+    dinv(InvSigma, n_dim, Sigma);
+  }
+  else if (!(errorM = dinvInfo(Sn, n_dim, mtemp, &step))) {
+    rngWish(InvSigma, mtemp, nu0+(int)n_eff, n_dim, stream);
+    errorM = dinvInfo(InvSigma, n_dim, Sigma, &step);
+  }
  
-  for (j=0; j<n_dim; j++)
-    for (k=0; k<n_dim; k++)
-      mtemp[j][k] = Sigma[j][k]/(tau0+n_samp);
-
-  rMVN(mu, mun, mtemp, n_dim);
+  if (!errorM) {
+    for (j=0; j<n_dim; j++)
+      for (k=0; k<n_dim; k++)
+	mtemp[j][k] = Sigma[j][k]/(tau0+n_eff);
+    rngMVN(mu, mun, mtemp, n_dim, stream);
+  }
 
   Free(Ybar);
   Free(mun);
   FreeMatrix(Sn, n_dim);
   FreeMatrix(mtemp, n_dim);
+  return errorM;
 }
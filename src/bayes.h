@@ -5,6 +5,7 @@
   Copyright: GPL version 2 or later.
 *******************************************************************/
 
-void NIWupdate(double **Y, double *mu, double **Sigma, double **InvSigma,
-	       double *mu0, double tau0, int nu0, double **S0, 
-	       int n_samp, int n_dim); 
+int NIWupdate(double **Y, double *mu, double **Sigma, double **InvSigma,
+	      double *mu0, double tau0, int nu0, double **S0, 
+	      int n_samp, int n_dim, double *weight,
+	      unsigned long long *stream); 
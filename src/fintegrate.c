@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include <Rmath.h>
 #include <R.h>
 #include <Rinternals.h>
@@ -22,161 +23,372 @@
 #include "fintegrate.h"
 //#include  <gsl/gsl_integration.h>
 
+/**
+ * Point t of the tomography line of an area (see areaLines in macros.h)
+ * mutates: W1, W2 (logit scale) and pfact, the length element of the line
+ * returns: 0 if W1 or W2 is 0 or 1 at t, 1 otherwise
+ */
+static int tomoPoint(double t, double lb1, double m1, double lb2, double m2,
+                     double* W1, double* W2, double* pfact) {
+  double w1=m1*t+lb1, w2=m2*t+lb2, W1p, W2p;
+  if (w1==1 || w1==0 || w2==1 || w2==0) return 0;
+  W1p=(1/w1)*(m1/(1-w1));
+  W2p=(1/w2)*(m2/(1-w2));
+  *W1=log(w1/(1-w1));
+  *W2=log(w2/(1-w2));
+  *pfact=sqrt(W1p*W1p+W2p*W2p);
+  return 1;
+}
+
+/**
+ * Set the constants of the bivariate normal density from setP->Sigma
+ * mutates: setP->dens
+ */
+void setDensityConst(setParam* setP) {
+  densityConst* c=&(setP->dens);
+  double s11=setP->Sigma[0][0], s22=setP->Sigma[1][1];
+  c->rho=setP->Sigma[0][1]/sqrt(s11*s22);
+  c->halfInvOneMinusRho2=1/(2*(1-c->rho*c->rho));
+  c->invS11=1/s11;
+  c->invS22=1/s22;
+  c->invSd12=1/sqrt(s11*s22);
+  c->norm=1/(2*M_PI*sqrt(s11*s22*(1-c->rho*c->rho)));
+  c->logNorm=log(c->norm);
+}
+
 /**
  * Bivariate normal distribution, with parameterization
  * see: http://mathworld.wolfram.com/BivariateNormalDistribution.html
  * see for param: http://www.math.uconn.edu/~binns/reviewII210.pdf
+ * Uses the constants in setP->dens; does not allocate
  */
 void NormConstT(double *t, int n, void *param)
 {
   int ii;
-  int dim=2;
-  double *mu=doubleArray(dim);
-  double **Sigma=doubleMatrix(dim,dim);
-  double *W1,*W1p,*W2,*W2p;
-  //  double X, Y, rho;
-  double rho;
-  //double dtemp, inp, pfact;
-  double dtemp, pfact;
-  int imposs;
-
-  W1 = doubleArray(n);
-  W1p = doubleArray(n);
-  W2 = doubleArray(n);
-  W2p = doubleArray(n);
-
   Param *pp=(Param *)param;
-  mu[0]= pp->caseP.mu[0];
-  mu[1]= pp->caseP.mu[1];
-  Sigma[0][0]=pp->setP->Sigma[0][0];
-  Sigma[1][1]=pp->setP->Sigma[1][1];
-  Sigma[0][1]=pp->setP->Sigma[0][1];
-  Sigma[1][0]=pp->setP->Sigma[1][0];
-  rho=Sigma[0][1]/sqrt(Sigma[0][0]*Sigma[1][1]);
-  //Rprintf("TESTING: %4g %4g %4g %4g", pp->caseP.mu[0], pp->caseP.mu[1], pp->setP->Sigma[0][0],pp->setP->Sigma[0][1]);
-  //X=pp->caseP.X;
-  //Y=pp->caseP.Y;
-  imposs=0;
-
-  dtemp=1/(2*M_PI*sqrt(Sigma[0][0]*Sigma[1][1]*(1-rho*rho)));
+  areaLines* L=&(pp->setP->lines);
+  densityConst* c=&(pp->setP->dens);
+  double W1,W2,pfact,d0,d1;
+  double lb1=L->W1lb[pp->caseP.id], m1=L->m1[pp->caseP.id];
+  double lb2=L->W2ub[pp->caseP.id], m2=L->m2[pp->caseP.id];
+  double mu0=pp->caseP.mu[0], mu1=pp->caseP.mu[1];
 
   for (ii=0; ii<n; ii++) {
-    imposs=0; // inp=t[ii]; 
-    W1[ii]=getW1starFromT(t[ii],pp,&imposs);
-    if (!imposs) W2[ii]=getW2starFromT(t[ii],pp,&imposs);
-    if (imposs==1) t[ii]=0;
+    if (!tomoPoint(t[ii],lb1,m1,lb2,m2,&W1,&W2,&pfact)) t[ii]=0;
     else {
-        W1p[ii]=getW1starPrimeFromT(t[ii],pp);
-        W2p[ii]=getW2starPrimeFromT(t[ii],pp);
-        pfact=sqrt(W1p[ii]*W1p[ii]+W2p[ii]*W2p[ii]);
-        t[ii]=exp(-1/(2*(1-rho*rho))*
-              ((W1[ii]-mu[0])*(W1[ii]-mu[0])/Sigma[0][0]+
-               (W2[ii]-mu[1])*(W2[ii]-mu[1])/Sigma[1][1]-
-                2*rho*(W1[ii]-mu[0])*(W2[ii]-mu[1])
-              /sqrt(Sigma[0][0]*Sigma[1][1])))*dtemp*pfact;
-  //if (pp->setP->weirdness)
-   //   Rprintf("Normc... %d %d %5g -> %5g %5g => %5g with %5g imposs %d\n", ii, n, inp, W1[ii], W2[ii],t[ii],pfact,imposs);
-      //char ch;
-      //scanf(" %c", &ch );
+      d0=W1-mu0; d1=W2-mu1;
+      t[ii]=exp(-c->halfInvOneMinusRho2*
+                (d0*d0*c->invS11+d1*d1*c->invS22-2*c->rho*d0*d1*c->invSd12))*c->norm*pfact;
     }
   }
-  Free(W1);
-  Free(W1p);
-  Free(W2);
-  Free(W2p);
-  Free(mu);
-  FreeMatrix(Sigma,dim);
 }
 
 /**
  * Integrand for computing sufficient statistic
  * Which statistic to estimate depends on param->suff (see macros.h)
+ * Uses the constants in setP->dens; does not allocate
  */
 void SuffExp(double *t, int n, void *param)
 {
-  int ii,imposs,i,j;
+  int ii;
   sufficient_stat suff;
   Param *pp=(Param *)param;
-  int dim = (pp->setP->ncar==1) ? 3 : 2;
-  double *mu=doubleArray(dim);
-  double **Sigma=doubleMatrix(dim,dim);
-  double **InvSigma=doubleMatrix(dim,dim);/* inverse covariance matrix*/
-  //double Sigma[dim][dim];
-  //double InvSigma[dim][dim];
-  double *W1,*W1p,*W2,*W2p,*vtemp;
-  // double inp,density,pfact,normc;
-  double density,pfact,normc;
-
-  vtemp=doubleArray(dim);
-  W1 = doubleArray(n);
-  W1p = doubleArray(n);
-  W2 = doubleArray(n);
-  W2p = doubleArray(n);
-  mu[0]= pp->caseP.mu[0];
-  mu[1]= pp->caseP.mu[1];
-  for(i=0;i<dim;i++) {
-    for(j=0;j<dim;j++) {
-      if (dim==3) {
-        Sigma[i][j]=pp->setP->Sigma3[i][j];
-        InvSigma[i][j]=pp->setP->InvSigma3[i][j];
-      }
-      else {
-        Sigma[i][j]=pp->setP->Sigma[i][j];
-        InvSigma[i][j]=pp->setP->InvSigma[i][j];
-      }
-    }
-  }
+  areaLines* L=&(pp->setP->lines);
+  double W1,W2,pfact,density,normc;
+  double vtemp[2];
+  double lb1=L->W1lb[pp->caseP.id], m1=L->m1[pp->caseP.id];
+  double lb2=L->W2ub[pp->caseP.id], m2=L->m2[pp->caseP.id];
+
   normc=pp->caseP.normcT;
   suff=pp->caseP.suff;
-  imposs=0;
 
   for (ii=0; ii<n; ii++) {
-    imposs=0; // inp=t[ii];
-    W1[ii]=getW1starFromT(t[ii],pp,&imposs);
-    if (!imposs) W2[ii]=getW2starFromT(t[ii],pp,&imposs);
-    if (imposs==1) t[ii]=0;
+    if (!tomoPoint(t[ii],lb1,m1,lb2,m2,&W1,&W2,&pfact)) t[ii]=0;
     else {
-      W1p[ii]=getW1starPrimeFromT(t[ii],pp);
-      W2p[ii]=getW2starPrimeFromT(t[ii],pp);
-      pfact=sqrt(W1p[ii]*W1p[ii]+W2p[ii]*W2p[ii]);
-      vtemp[0] = W1[ii];
-      vtemp[1] = W2[ii];
+      vtemp[0]=W1;
+      vtemp[1]=W2;
       density=dBVNtomo(vtemp, pp, 0,normc);
       t[ii] = density*pfact;
-      if (suff==SS_W1star) t[ii]=W1[ii]*t[ii];
-      else if (suff==SS_W2star) t[ii]=W2[ii]*t[ii];
-      else if (suff==SS_W1star2) t[ii]=W1[ii]*W1[ii]*t[ii];
-      else if (suff==SS_W1W2star) t[ii]=W1[ii]*W2[ii]*t[ii];
-      else if (suff==SS_W2star2) t[ii]=W2[ii]*W2[ii]*t[ii];
-      else if (suff==SS_W1) t[ii]=invLogit(W1[ii])*t[ii];
-      else if (suff==SS_W2) t[ii]=invLogit(W2[ii])*t[ii];
-      else if (suff==SS_Loglik) {
-        if (dim == 3) {
-          //if(pp->setP->verbose>=2 && dim==3) Rprintf("InvSigma loglik: %5g %5g %5g %5g %5g %5g\n",InvSigma[0][0],InvSigma[0][1],InvSigma[1][0],InvSigma[1][1],InvSigma[1][2],InvSigma[2][2]);
-          vtemp[2]=logit(pp->caseP.X,"log-likelihood");
-          mu[0]=pp->setP->pdTheta[1];
-          mu[1]=pp->setP->pdTheta[2];
-          mu[2]=pp->setP->pdTheta[0];
-        }
-        t[ii]=dMVN(vtemp,mu,InvSigma,dim,0)*pfact;
-        //t[ii]=dMVN3(vtemp,mu,(double*)(&(InvSigma[0][0])),dim,0)*pfact;
-      }
+      if (suff==SS_W1star) t[ii]=W1*t[ii];
+      else if (suff==SS_W2star) t[ii]=W2*t[ii];
+      else if (suff==SS_W1star2) t[ii]=W1*W1*t[ii];
+      else if (suff==SS_W1W2star) t[ii]=W1*W2*t[ii];
+      else if (suff==SS_W2star2) t[ii]=W2*W2*t[ii];
+      else if (suff==SS_W1) t[ii]=invLogit(W1)*t[ii];
+      else if (suff==SS_W2) t[ii]=invLogit(W2)*t[ii];
       else if (suff!=SS_Test) Rprintf("Error Suff= %d",suff);
     }
   }
-  Free(W1);Free(W1p);Free(W2);Free(W2p);Free(mu);Free(vtemp);
-  FreeMatrix(Sigma,dim); FreeMatrix(InvSigma,dim);
+}
+
+/**
+ * Fused integrand for the E-step: evaluates the (unnormalized) density on the
+ * tomography line once per node and returns it together with all the moments
+ * (see e_moments in macros.h). out is n x nf; only the first nf components are filled.
+ * Dividing the integrals of components 1..nf-1 by the integral of component 0
+ * gives the conditional expectations that SuffExp computes one at a time.
+ */
+void SuffExpAll(double *t, int n, double *out, int nf, void *param)
+{
+  int ii,k;
+  Param *pp=(Param *)param;
+  areaLines* L=&(pp->setP->lines);
+  densityConst* c=&(pp->setP->dens);
+  double W1,W2,pfact,dens,d0,d1;
+  double m[MOM_Len];
+  //the line through this area, read once for all the nodes
+  double lb1=L->W1lb[pp->caseP.id], m1=L->m1[pp->caseP.id];
+  double lb2=L->W2ub[pp->caseP.id], m2=L->m2[pp->caseP.id];
+  double mu0=pp->caseP.mu[0], mu1=pp->caseP.mu[1];
+
+  for (ii=0; ii<n; ii++) {
+    if (!tomoPoint(t[ii],lb1,m1,lb2,m2,&W1,&W2,&pfact)) {
+      for (k=0; k<nf; k++) out[ii*nf+k]=0;
+    }
+    else {
+      d0=W1-mu0; d1=W2-mu1;
+      dens=exp(-c->halfInvOneMinusRho2*
+               (d0*d0*c->invS11+d1*d1*c->invS22-2*c->rho*d0*d1*c->invSd12))*c->norm*pfact;
+      m[MOM_NormC]=dens;
+      m[MOM_W1star]=W1*dens;
+      m[MOM_W2star]=W2*dens;
+      m[MOM_W1star2]=W1*W1*dens;
+      m[MOM_W1W2star]=W1*W2*dens;
+      m[MOM_W2star2]=W2*W2*dens;
+      m[MOM_W1]=invLogit(W1)*dens;
+      m[MOM_W2]=invLogit(W2)*dens;
+      for (k=0; k<nf; k++) out[ii*nf+k]=m[k];
+    }
+  }
+}
+
+/**
+ * Number of parameters whose information Louis' method computes (see ecoMissingInfo):
+ * those in pdTheta, less rho under CAR with fixed rho
+ */
+int infoParamLen(setParam* setP) {
+  if (setP->ncar) return 9;
+  return setP->fixedRho ? 4 : 5;
+}
+
+/* kind of each parameter of the missing information (0=mean, 1=variance, 2=correlation)
+ * and the variables it involves, indexed as in Sigma3: 0=W1*, 1=W2*, 2=X* */
+static const int carKind[5]={0,0,1,1,2}, carV[5]={0,1,0,1,0}, carW[5]={0,1,0,1,1};
+static const int ncarKind[9]={0,0,0,1,1,1,2,2,2}, ncarV[9]={2,0,1,2,0,1,0,1,0}, ncarW[9]={2,0,1,2,0,1,2,2,1};
+
+/**
+ * Shared setup of the complete-data scores (see InfoExpAll): the full mean, the inverse
+ * covariance and the factor of each score part.
+ * mutates: mu, P, coef
+ * returns: the dimension (2, or 3 under NCAR)
+ */
+static int infoScoreSetup(setParam* setP, double *mu, double P[3][3], double *coef) {
+  int j,k,d,p=infoParamLen(setP);
+  const int *kind,*v,*w;
+  double S[3][3],r;
+  if (setP->ncar) {
+    d=3; kind=ncarKind; v=ncarV; w=ncarW;
+    mu[0]=setP->pdTheta[1]; mu[1]=setP->pdTheta[2]; mu[2]=setP->pdTheta[0];
+    for (j=0; j<d; j++)
+      for (k=0; k<d; k++) {
+        P[j][k]=setP->InvSigma3[j][k];
+        S[j][k]=setP->Sigma3[j][k];
+      }
+  }
+  else {
+    d=2; kind=carKind; v=carV; w=carW;
+    mu[0]=setP->pdTheta[0]; mu[1]=setP->pdTheta[1];
+    for (j=0; j<d; j++)
+      for (k=0; k<d; k++) {
+        P[j][k]=setP->InvSigma[j][k];
+        S[j][k]=setP->Sigma[j][k];
+      }
+  }
+  for (j=0; j<p; j++) {
+    if (kind[j]==2) {
+      r=S[v[j]][w[j]]/sqrt(S[v[j]][v[j]]*S[w[j]][w[j]]);
+      coef[j]=sqrt(S[v[j]][v[j]]*S[w[j]][w[j]])*(1-r*r);
+    }
+    else coef[j]=(kind[j]==1) ? 0.5 : 1;
+  }
+  return d;
+}
+
+/**
+ * The parts f of the complete-data scores, given the deviation e from the full mean
+ * mutates: f (length infoParamLen)
+ */
+static void infoScore(setParam* setP, int d, double *e, double P[3][3], double *coef, double *f) {
+  int j,k,p=infoParamLen(setP);
+  const int *kind=setP->ncar ? ncarKind : carKind, *v=setP->ncar ? ncarV : carV;
+  const int *w=setP->ncar ? ncarW : carW;
+  double a[3];
+  for (j=0; j<d; j++) {
+    a[j]=0;
+    for (k=0; k<d; k++) a[j]+=P[j][k]*e[k];
+  }
+  for (j=0; j<p; j++) {
+    if (kind[j]==0) f[j]=a[v[j]];
+    else if (kind[j]==1) f[j]=coef[j]*a[v[j]]*e[v[j]];
+    else f[j]=coef[j]*a[v[j]]*a[w[j]];
+  }
+}
+
+/**
+ * Integrand for the missing information (see ecoMissingInfo): the density on the
+ * tomography line, as in SuffExpAll, times 1, the part of each complete-data score that
+ * depends on the missing W, and the pairwise products of those parts.
+ * The scores are those of the first infoParamLen parameters of pdTheta, on the scale of
+ * transformTheta (means, log variances and Fisher-transformed correlations).
+ * With e the deviation of (W1*,W2*[,X*]) from its mean and a=InvSigma e, the score parts
+ * are a_v for a mean, a_v e_v/2 for a log variance and a_v a_w sqrt(s_v s_w)(1-r_vw^2)
+ * for a correlation
+ * out is n x nf, nf=1+p+p(p+1)/2; the products are in the order (0,0),(0,1),..,(0,p-1),(1,1),..
+ */
+void InfoExpAll(double *t, int n, double *out, int nf, void *param)
+{
+  int ii,j,k,l,p,d;
+  Param *pp=(Param *)param;
+  setParam* setP=pp->setP;
+  areaLines* L=&(setP->lines);
+  densityConst* c=&(setP->dens);
+  double W1,W2,pfact,dens,d0,d1;
+  double mu[3],e[3],P[3][3],coef[9],f[9];
+  double lb1=L->W1lb[pp->caseP.id], m1=L->m1[pp->caseP.id];
+  double lb2=L->W2ub[pp->caseP.id], m2=L->m2[pp->caseP.id];
+  double mu0=pp->caseP.mu[0], mu1=pp->caseP.mu[1];
+
+  p=infoParamLen(setP);
+  d=infoScoreSetup(setP,mu,P,coef);
+  if (setP->ncar) e[2]=logit(pp->caseP.X,"missing information")-mu[2];
+
+  for (ii=0; ii<n; ii++) {
+    if (!tomoPoint(t[ii],lb1,m1,lb2,m2,&W1,&W2,&pfact)) {
+      for (k=0; k<nf; k++) out[ii*nf+k]=0;
+      continue;
+    }
+    d0=W1-mu0; d1=W2-mu1;
+    dens=exp(-c->halfInvOneMinusRho2*
+             (d0*d0*c->invS11+d1*d1*c->invS22-2*c->rho*d0*d1*c->invSd12))*c->norm*pfact;
+    e[0]=W1-mu[0]; e[1]=W2-mu[1];
+    infoScore(setP,d,e,P,coef,f);
+    out[ii*nf]=dens;
+    l=1;
+    for (j=0; j<p; j++) out[ii*nf+(l++)]=f[j]*dens;
+    for (j=0; j<p; j++)
+      for (k=j; k<p; k++) out[ii*nf+(l++)]=f[j]*f[k]*dens;
+  }
+}
+
+/**
+ * The moments of InfoExpAll for a homogeneous area under CAR, where one of W1*, W2* is
+ * known and the other is conditionally normal. The score parts are at most quadratic in
+ * the unknown one, so the 3-point Gauss-Hermite rule is exact.
+ * mutates: out (length nf, out[0]=1)
+ */
+void InfoHomog(Param* param, double *out, int nf)
+{
+  static const double node[3]={-1.7320508075688772,0,1.7320508075688772}, wt[3]={1.0/6,2.0/3,1.0/6};
+  setParam* setP=param->setP;
+  int j,k,l,g,d,p=infoParamLen(setP);
+  int known=(param->caseP.dataType==DPT_Homog_X1) ? 0 : 1, miss=1-known;
+  double mu[3],e[3],P[3][3],coef[9],f[9],cm,cv;
+
+  d=infoScoreSetup(setP,mu,P,coef);
+  //W_miss* given W_known*: the conditional normal of the CAR model
+  e[known]=param->caseP.Wstar[known]-mu[known];
+  cm=setP->Sigma[miss][known]/setP->Sigma[known][known]*e[known];
+  cv=setP->Sigma[miss][miss]-setP->Sigma[miss][known]*setP->Sigma[miss][known]/setP->Sigma[known][known];
+  for (k=0; k<nf; k++) out[k]=0;
+  out[0]=1;
+  for (g=0; g<3; g++) {
+    e[miss]=cm+node[g]*sqrt(cv);
+    infoScore(setP,d,e,P,coef,f);
+    l=1;
+    for (j=0; j<p; j++) out[l++]+=wt[g]*f[j];
+    for (j=0; j<p; j++)
+      for (k=j; k<p; k++) out[l++]+=wt[g]*f[j]*f[k];
+  }
+}
+
+
+/**
+ * Gradient of the observed log-likelihood from the sufficient statistics of ecoEStep
+ * (means over t_weight areas): by Fisher's identity, the sum over the areas of the
+ * expected complete-data scores given Y, on the scale of InfoExpAll. With M the sum of
+ * E[e e'] and n=t_weight, it is (P sum E[e])_v for a mean, ((PM)_vv-n)/2 for a log
+ * variance and sqrt(s_v s_w)(1-r_vw^2)((PMP)_vw-n P_vw) for a correlation.
+ * Uses the mu and Sigma of the current setP->pdTheta
+ * mutates: score (length infoParamLen)
+ */
+void scoreSuff(setParam* setP, double* suff, double* score)
+{
+  int j,k,l,d,p=infoParamLen(setP);
+  const int *kind=setP->ncar ? ncarKind : carKind, *v=setP->ncar ? ncarV : carV;
+  const int *w=setP->ncar ? ncarW : carW;
+  double n=setP->t_weight;
+  double mu[3],P[3][3],coef[9],E1[3],E2[3][3],M[3][3],PM[3][3],PMP[3][3],a[3];
+
+  d=infoScoreSetup(setP,mu,P,coef);
+  if (setP->ncar) {
+    E1[0]=suff[1]; E1[1]=suff[2]; E1[2]=suff[0];
+    E2[0][0]=suff[4]; E2[1][1]=suff[5]; E2[2][2]=suff[3];
+    E2[0][1]=suff[8]; E2[0][2]=suff[6]; E2[1][2]=suff[7];
+  }
+  else {
+    E1[0]=suff[0]; E1[1]=suff[1];
+    E2[0][0]=suff[2]; E2[1][1]=suff[3]; E2[0][1]=suff[4];
+  }
+  for (j=0; j<d; j++)
+    for (k=j; k<d; k++) {
+      M[j][k]=n*(E2[j][k]-E1[j]*mu[k]-mu[j]*E1[k]+mu[j]*mu[k]);
+      M[k][j]=M[j][k];
+    }
+  for (j=0; j<d; j++) {
+    a[j]=0;
+    for (k=0; k<d; k++) {
+      a[j]+=P[j][k]*n*(E1[k]-mu[k]);
+      PM[j][k]=0;
+      for (l=0; l<d; l++) PM[j][k]+=P[j][l]*M[l][k];
+    }
+  }
+  for (j=0; j<d; j++)
+    for (k=0; k<d; k++) {
+      PMP[j][k]=0;
+      for (l=0; l<d; l++) PMP[j][k]+=PM[j][l]*P[l][k];
+    }
+  for (j=0; j<p; j++) {
+    if (kind[j]==0) score[j]=a[v[j]];
+    else if (kind[j]==1) score[j]=coef[j]*(PM[v[j]][v[j]]-n);
+    else score[j]=coef[j]*(PMP[v[j]][w[j]]-n*P[v[j]][w[j]]);
+  }
 }
 
 
+/**
+ * Log likelihood of a general area from caseP.normcT, the integral of the density of
+ * (W1*,W2*) on its tomography line (see setMoments, setNormConst), so that the E-step
+ * gets it without another integral. Under NCAR that density is conditional on X*,
+ * and the normal density of X* is added.
+ */
+double normCLogLikelihood(Param* param) {
+  setParam* setP=param->setP;
+  double loglik=log(param->caseP.normcT), dx;
+  if (setP->ncar) {
+    dx=logit(param->caseP.X,"log-likelihood X")-setP->pdTheta[0];
+    loglik+=-0.5*log(2*M_PI*setP->pdTheta[3])-0.5*dx*dx/setP->pdTheta[3];
+  }
+  return loglik;
+}
+
 /**
  * Returns the log likelihood of a particular case (i.e, record, datapoint)
  */
 double getLogLikelihood(Param* param) {
-  if (param->caseP.dataType==DPT_General  && !(param->caseP.Y>=.990 || param->caseP.Y<=.010)) {
-    //non-survey data: do integration to find likelihood
-    param->caseP.suff=SS_Loglik;
-    return log(paramIntegration(&SuffExp,(void*)param));
+  if (param->caseP.dataType==DPT_General  && !param->setP->lines.degenerate[param->caseP.id]) {
+    //non-survey data: the likelihood is the normalizing constant on the tomography line
+    setNormConst(param);
+    return normCLogLikelihood(param);
 
 
   } else if (param->caseP.dataType==DPT_Homog_X1 || param->caseP.dataType==DPT_Homog_X0) {
@@ -194,7 +406,7 @@ double getLogLikelihood(Param* param) {
       return log(lik);
       // return 0; //fix later
 
-  } else if (param->caseP.dataType==DPT_Survey || (param->caseP.Y>=.990 || param->caseP.Y<=.010)) {
+  } else if (param->caseP.dataType==DPT_Survey || param->setP->lines.degenerate[param->caseP.id]) {
     //Survey data (or v tight bounds): multi-variate normal
     int dim=param->setP->ncar ? 3 : 2;
     double *mu=doubleArray(dim);
@@ -288,7 +500,8 @@ double getW1FromW2(double X, double Y, double W2) {
  * mutates impossible to true if W1 is non-finite at t
  */
 double getW1starFromT(double t, Param* param, int* imposs) {
-  double W1=(param->caseP.Wbounds[0][1] - param->caseP.Wbounds[0][0])*t + param->caseP.Wbounds[0][0];
+  areaLines* L=&(param->setP->lines);
+  double W1=L->m1[param->caseP.id]*t + L->W1lb[param->caseP.id];
   if (W1==1 || W1==0) *imposs=1;
   else W1=log(W1/(1-W1));
   return W1;
@@ -296,10 +509,11 @@ double getW1starFromT(double t, Param* param, int* imposs) {
 
 /**
  * W2star(t)
- * W2(t)=(W2_lb - W2_ub)*t + W2_lb
+ * W2(t)=(W2_lb - W2_ub)*t + W2_ub
  */
 double getW2starFromT(double t, Param* param, int* imposs) {
-  double W2=(param->caseP.Wbounds[1][0] - param->caseP.Wbounds[1][1])*t + param->caseP.Wbounds[1][1];
+  areaLines* L=&(param->setP->lines);
+  double W2=L->m2[param->caseP.id]*t + L->W2ub[param->caseP.id];
   if (W2==1 || W2==0) *imposs=1;
   else W2=log(W2/(1-W2));
   return W2;
@@ -310,8 +524,9 @@ double getW2starFromT(double t, Param* param, int* imposs) {
  * see paper for derivation: W1*(t) = (1/W1)*((w1_ub - w1_lb)/(1-W1)
  */
 double getW1starPrimeFromT(double t, Param* param) {
-  double m=(param->caseP.Wbounds[0][1] - param->caseP.Wbounds[0][0]);
-  double W1=m*t + param->caseP.Wbounds[0][0];
+  areaLines* L=&(param->setP->lines);
+  double m=L->m1[param->caseP.id];
+  double W1=m*t + L->W1lb[param->caseP.id];
   W1=(1/W1)*(m/(1-W1));
   return W1;
 }
@@ -321,39 +536,344 @@ double getW1starPrimeFromT(double t, Param* param) {
  * see paper for derivation: W2*(t) = (1/W2)*((w2_lb - w2_ub)/(1-W2)
  */
 double getW2starPrimeFromT(double t, Param* param) {
-  double m=(param->caseP.Wbounds[1][0] - param->caseP.Wbounds[1][1]);
-  double W2=m*t + param->caseP.Wbounds[1][1];
+  areaLines* L=&(param->setP->lines);
+  double m=L->m2[param->caseP.id];
+  double W2=m*t + L->W2ub[param->caseP.id];
   W2=(1/W2)*(m/(1-W2));
   return W2;
 }
 
+/* bounds of the line parameter t shared by all the backends */
+static const double tLower=0.00001, tUpper=.99999;
+/* tolerance (relative to the normalizing constant) the error estimate of a fixed rule must meet;
+ * the estimate is that of the embedded lower order rule, so the rule itself is typically far more
+ * accurate. Integrands that fail it are handed to the adaptive routine */
+static const double quadFixedTol=1e-9;
+/* the fixed rules evaluate their integrand this many nodes at a time, in stack buffers */
+#define QUAD_CHUNK 64
+/* subdivision limit of the adaptive routines */
+#define QUAD_LIMIT 100
+
+/**
+ * n-point Gauss-Legendre nodes and weights on [-1,1] by Newton iteration on P_n
+ * mutates: x, w (length n)
+ */
+static void gaussLegendre(int n, double *x, double *w) {
+  int i,j,it;
+  double z,z1,p1,p2,p3,pp=1;
+  for (i=0; i<(n+1)/2; i++) {
+    z=cos(M_PI*(i+0.75)/(n+0.5));
+    for (it=0; it<100; it++) {
+      p1=1; p2=0;
+      for (j=0; j<n; j++) {
+        p3=p2; p2=p1;
+        p1=((2*j+1)*z*p2-j*p3)/(j+1);
+      }
+      pp=n*(z*p1-p2)/(z*z-1);
+      z1=z; z=z1-p1/pp;
+      if (fabs(z-z1)<=3*DBL_EPSILON) break;
+    }
+    x[i]=-z; x[n-1-i]=z;
+    w[i]=w[n-1-i]=2/((1-z*z)*pp*pp);
+  }
+}
+
+/**
+ * Precompute a fixed-order rule on [tLower,tUpper]
+ *  QUAD_GaussLegendre: order-point rule, error estimated against the order/2-point rule
+ *  QUAD_TanhSinh: step 2^-order over |kh|<=3, error estimated against step 2^-(order-1)
+ *  QUAD_Adaptive: nothing to precompute, the integrals use Rdqags
+ * mutates: q
+ */
+void initQuadRule(quadRule* q, int type, int order) {
+  int i,k,m,kmax;
+  double c=0.5*(tLower+tUpper), h=0.5*(tUpper-tLower);
+  double step,u,v,wk;
+  q->type=type; q->order=order; q->n=0;
+  q->node=NULL; q->weight=NULL; q->errWeight=NULL;
+  if (type==QUAD_GaussLegendre) {
+    if (order<2) error("Gauss-Legendre quadrature needs at least 2 nodes");
+    m=order/2;
+    q->n=order+m;
+    q->node=doubleArray(q->n); q->weight=doubleArray(q->n); q->errWeight=doubleArray(q->n);
+    gaussLegendre(order,q->node,q->weight);
+    gaussLegendre(m,q->node+order,q->errWeight+order);
+    for (i=0; i<q->n; i++) {
+      if (i<order) q->errWeight[i]=q->weight[i];
+      else {
+        q->weight[i]=0;
+        q->errWeight[i]=-q->errWeight[i];
+      }
+      q->node[i]=c+h*q->node[i];
+      q->weight[i]*=h; q->errWeight[i]*=h;
+    }
+  }
+  else if (type==QUAD_TanhSinh) {
+    if (order<1) error("tanh-sinh quadrature needs a level of at least 1");
+    step=ldexp(1.0,-order);
+    kmax=(int)ceil(3/step);
+    q->n=2*kmax+1;
+    q->node=doubleArray(q->n); q->weight=doubleArray(q->n); q->errWeight=doubleArray(q->n);
+    for (k=-kmax; k<=kmax; k++) {
+      u=M_PI_2*sinh(k*step);
+      v=cosh(u);
+      wk=step*M_PI_2*cosh(k*step)/(v*v);
+      i=k+kmax;
+      q->node[i]=c+h*tanh(u);
+      q->weight[i]=h*wk;
+      //the half-step rule has weight 2*wk on even k and none on odd k
+      q->errWeight[i]=(k%2==0) ? -h*wk : h*wk;
+    }
+  }
+  else if (type!=QUAD_Adaptive) error("Unknown quadrature type %d",type);
+}
+
+/**
+ * Release the arrays held by a quadRule
+ */
+void freeQuadRule(quadRule* q) {
+  if (q->n>0) {
+    Free(q->node); Free(q->weight); Free(q->errWeight);
+  }
+  q->n=0;
+}
+
+/**
+ * Apply a fixed rule to a scalar integrand
+ * mutates: err, the error estimate
+ * returns: the integral
+ */
+static double fixedIntegration(integr_fn f, void *ex, quadRule* q, double* err) {
+  int i,start,len;
+  double res=0, e=0;
+  double x[QUAD_CHUNK];
+  for (start=0; start<q->n; start+=QUAD_CHUNK) {
+    len=imin2(QUAD_CHUNK,q->n-start);
+    for (i=0; i<len; i++) x[i]=q->node[start+i];
+    f(x,len,ex);
+    for (i=0; i<len; i++) {
+      res+=q->weight[start+i]*x[i];
+      e+=q->errWeight[start+i]*x[i];
+    }
+  }
+  *err=fabs(e);
+  return res;
+}
+
+/**
+ * Apply a fixed rule to every component of a vector-valued integrand
+ * mutates: result, err (length nf, at most VEC_MaxLen)
+ */
+static void vecFixedIntegration(vec_integr_fn f, void *ex, int nf, quadRule* q,
+                                double *result, double *err) {
+  int i,k,start,len;
+  double fv[QUAD_CHUNK*VEC_MaxLen];
+  for (k=0; k<nf; k++) {
+    result[k]=0; err[k]=0;
+  }
+  for (start=0; start<q->n; start+=QUAD_CHUNK) {
+    len=imin2(QUAD_CHUNK,q->n-start);
+    f(q->node+start,len,fv,nf,ex);
+    for (i=0; i<len; i++)
+      for (k=0; k<nf; k++) {
+        result[k]+=q->weight[start+i]*fv[i*nf+k];
+        err[k]+=q->errWeight[start+i]*fv[i*nf+k];
+      }
+  }
+  for (k=0; k<nf; k++) err[k]=fabs(err[k]);
+}
+
 /**
  * parameterized line integration
  * lower bound is t=0, upper bound is t=1
+ * Uses the fixed rule in setP->quad when one is set and its error estimate
+ * is small enough, Rdqags otherwise
+ * Rdqags failures are recorded in caseP.intErr rather than printed, since
+ * areas may be integrated in parallel (see printIntegrationError)
  */
 double paramIntegration(integr_fn f, void *ex) {
-  double epsabs=pow(10,-11), epsrel=pow(10,-11);
+  double epsabs=INT_Tol, epsrel=INT_Tol;
   double result=9999, anserr=9999;
-  int limit=100;
+  int limit=QUAD_LIMIT;
   int last, neval, ier;
-  int lenw=5*limit;
-  int *iwork=(int *) Calloc(limit, int);
-  double *work=(double *)Calloc(lenw, double);
-  double lb=0.00001; double ub=.99999;
+  int lenw=5*QUAD_LIMIT;
+  int iwork[QUAD_LIMIT];
+  double work[5*QUAD_LIMIT];
+  quadRule* q=&(((Param*)ex)->setP->quad);
+  if (q->type!=QUAD_Adaptive) {
+    result=fixedIntegration(f,ex,q,&anserr);
+    if (anserr<=quadFixedTol*fabs(result)) return result;
+  }
+  double lb=tLower; double ub=tUpper;
   Rdqags(f, ex, &lb, &ub, &epsabs, &epsrel, &result,
     &anserr, &neval, &ier, &limit, &lenw, &last, iwork, work);
 
-  Free(iwork);
-  Free(work);
-  if (ier==0) return result;
-  else {
+  if (ier!=0) {
+    Param* p = (Param*) ex;
+    p->caseP.intErr=ier;
+    p->caseP.intErrSuff=p->caseP.suff;
+    p->caseP.intErrResult[0]=result;
+    p->caseP.intErrResult[1]=anserr;
+  }
+  return result;
+}
+
+/* 21-point Gauss-Kronrod rule, as in QUADPACK's qk21 (used by Rdqags) */
+static const double xgk21[11]={0.995657163025808080735527280689003, 0.973906528517171720077964012084452,
+  0.930157491355708226001207180059508, 0.865063366688984510732096688423493,
+  0.780817726586416897063717578345042, 0.679409568299024406234327365114874,
+  0.562757134668604683339000099272694, 0.433395394129247190799265943165784,
+  0.294392862701460198131126603103866, 0.148874338981631210884826001129720, 0.0};
+static const double wgk21[11]={0.011694638867371874278064396062192, 0.032558162307964727478818972459390,
+  0.054755896574351996031381300244580, 0.075039674810919952767043140916190,
+  0.093125454583697605535065465083366, 0.109387158802297641899210590325805,
+  0.123491976262065851077600525765302, 0.134709217311473325928054001771707,
+  0.142775938577060080797094273138717, 0.147739104901338491374841515972068,
+  0.149445554002916905664936468389821};
+static const double wg10[5]={0.066671344308688137593568809893332, 0.149451349150580593145776339657697,
+  0.219086362515982043995534934228163, 0.269266719309996355091226921569469,
+  0.295524224714752870173892994651338};
+
+/**
+ * Applies the 21-point Gauss-Kronrod rule to every component of f on [a,b]
+ * x (21) and fv (21 x nf) are scratch space
+ * mutates: res, err (length nf), the Kronrod estimates and their error estimates
+ */
+static void vecQK21(vec_integr_fn f, void *ex, int nf, double a, double b,
+                    double *x, double *fv, double *res, double *err) {
+  int j,k;
+  double c=0.5*(a+b), h=0.5*(b-a);
+  double rk,rg,rabs,rasc,mean;
+
+  x[0]=c;
+  for (j=0; j<10; j++) {
+    x[2*j+1]=c-h*xgk21[j];
+    x[2*j+2]=c+h*xgk21[j];
+  }
+  f(x,21,fv,nf,ex);
+  for (k=0; k<nf; k++) {
+    rk=wgk21[10]*fv[k]; rg=0; rabs=fabs(rk);
+    for (j=0; j<10; j++) {
+      rk+=wgk21[j]*(fv[(2*j+1)*nf+k]+fv[(2*j+2)*nf+k]);
+      rabs+=wgk21[j]*(fabs(fv[(2*j+1)*nf+k])+fabs(fv[(2*j+2)*nf+k]));
+      if (j%2==1) rg+=wg10[j/2]*(fv[(2*j+1)*nf+k]+fv[(2*j+2)*nf+k]);
+    }
+    mean=rk*0.5;
+    rasc=wgk21[10]*fabs(fv[k]-mean);
+    for (j=0; j<10; j++)
+      rasc+=wgk21[j]*(fabs(fv[(2*j+1)*nf+k]-mean)+fabs(fv[(2*j+2)*nf+k]-mean));
+    res[k]=rk*h;
+    err[k]=fabs((rk-rg)*h);
+    rasc*=fabs(h); rabs*=fabs(h);
+    //same error heuristic as qk21
+    if (rasc!=0 && err[k]!=0) err[k]=rasc*fmin2(1,pow(200*err[k]/rasc,1.5));
+    if (rabs>DBL_MIN/(50*DBL_EPSILON)) err[k]=fmax2(50*DBL_EPSILON*rabs,err[k]);
+  }
+}
+
+/**
+ * parameterized line integration of a vector-valued integrand
+ * lower bound is t=0, upper bound is t=1
+ * Globally adaptive Gauss-Kronrod: every component shares the same subdivision,
+ * so f is evaluated once per node for all nf integrals. Absolute tolerances are
+ * relative to the first component (the normalizing constant), so that they match
+ * the tolerance paramIntegration applies to the normalized integrands.
+ * The tolerance is setP->intTol, which the EM loosens while theta is far from
+ * the MLE (see ecoIntTol); a fixed rule in setP->quad is tried first, as in
+ * paramIntegration, and accepted at the looser of its own tolerance and that one.
+ * mutates: result (length nf, at most VEC_MaxLen)
+ * returns: 0 on success, 1 if the subdivision limit was reached, 2 if an
+ *   interval became too small to bisect; failures are also recorded in caseP.intErr
+ */
+int vecParamIntegration(vec_integr_fn f, void *ex, int nf, double *result) {
+  double epsabs=((Param*)ex)->setP->intTol, epsrel=epsabs;
+  int limit=QUAD_LIMIT;
+  double lb=tLower; double ub=tUpper;
+  int i,k,last,worst,ier,done;
+  double tol,scaled,maxscaled,mid;
+  //work space on the stack: the E-step calls this for every area, possibly from several threads
+  double alist[QUAD_LIMIT], blist[QUAD_LIMIT];
+  double rlist[QUAD_LIMIT*VEC_MaxLen], elist[QUAD_LIMIT*VEC_MaxLen];
+  double errsum[VEC_MaxLen], x[21], fv[21*VEC_MaxLen];
+  quadRule* q=&(((Param*)ex)->setP->quad);
+  if (nf>VEC_MaxLen) error("vecParamIntegration: at most %d integrands", VEC_MaxLen);
+  if (q->type!=QUAD_Adaptive) {
+    vecFixedIntegration(f,ex,nf,q,result,errsum);
+    done=1;
+    for (k=0; k<nf; k++)
+      if (errsum[k]>fmax2(quadFixedTol,epsrel)*fmax2(fabs(result[0]),fabs(result[k]))) done=0;
+    if (done) return 0;
+  }
+
+  alist[0]=lb; blist[0]=ub;
+  vecQK21(f,ex,nf,lb,ub,x,fv,rlist,elist);
+  last=1; ier=0;
+  while (1) {
+    for (k=0; k<nf; k++) {
+      result[k]=0; errsum[k]=0;
+      for (i=0; i<last; i++) {
+        result[k]+=rlist[i*nf+k];
+        errsum[k]+=elist[i*nf+k];
+      }
+    }
+    done=1;
+    for (k=0; k<nf; k++)
+      if (errsum[k]>fmax2(epsabs*fabs(result[0]),epsrel*fabs(result[k]))) done=0;
+    if (done) break;
+    if (last==limit) { ier=1; break; }
+
+    //bisect the interval contributing the largest error relative to its tolerance
+    worst=0; maxscaled=-1;
+    for (i=0; i<last; i++)
+      for (k=0; k<nf; k++) {
+        tol=fmax2(epsabs*fabs(result[0]),epsrel*fabs(result[k]));
+        scaled=(tol>0) ? elist[i*nf+k]/tol : elist[i*nf+k];
+        if (scaled>maxscaled) { maxscaled=scaled; worst=i; }
+      }
+    mid=0.5*(alist[worst]+blist[worst]);
+    if (mid<=alist[worst] || mid>=blist[worst]) { ier=2; break; }
+    alist[last]=mid; blist[last]=blist[worst]; blist[worst]=mid;
+    vecQK21(f,ex,nf,alist[worst],blist[worst],x,fv,rlist+worst*nf,elist+worst*nf);
+    vecQK21(f,ex,nf,alist[last],blist[last],x,fv,rlist+last*nf,elist+last*nf);
+    last++;
+  }
+
+  if (ier!=0) {
     Param* p = (Param*) ex;
-    Rprintf("Integration error %d: Sf %d X %5g Y %5g [%5g,%5g] -> %5g +- %5g\n",ier,p->caseP.suff,p->caseP.X,p->caseP.Y,p->caseP.Wbounds[0][0],p->caseP.Wbounds[0][1],result,anserr);
-    // char ch;
-    // scanf("Hit enter to continue %c", &ch );
-    return result;
+    p->caseP.intErr=ier;
+    p->caseP.intErrSuff=-1;
+    p->caseP.intErrResult[0]=result[0];
+    p->caseP.intErrResult[1]=errsum[0];
   }
+  return ier;
+}
 
+/**
+ * Print the integration failure recorded for an area, if any, and clear it.
+ * Called from serial code once the (possibly parallel) integrals are done
+ */
+void printIntegrationError(Param* param) {
+  caseParam* c=&(param->caseP);
+  if (c->intErr==0) return;
+  if (c->intErrSuff<0)
+    Rprintf("Integration error %d: moments X %5g Y %5g [%5g,%5g] -> %5g +- %5g\n",c->intErr,c->X,c->Y,c->Wbounds[0][0],c->Wbounds[0][1],c->intErrResult[0],c->intErrResult[1]);
+  else
+    Rprintf("Integration error %d: Sf %d X %5g Y %5g [%5g,%5g] -> %5g +- %5g\n",c->intErr,c->intErrSuff,c->X,c->Y,c->Wbounds[0][0],c->Wbounds[0][1],c->intErrResult[0],c->intErrResult[1]);
+  c->intErr=0;
+}
+
+/**
+ * integrate the normalizing constant and all E-step moments in a single pass
+ * (see SuffExpAll) and set the normalizing constant in param
+ * mutates: moments (length MOM_Len); moments[MOM_NormC] holds the normalizing
+ *   constant and the other entries hold the conditional expectations
+ */
+void setMoments(Param* param, double* moments) {
+  int k;
+  vecParamIntegration(&SuffExpAll,(void*)param,MOM_Len,moments);
+  param->caseP.normcT=moments[MOM_NormC];
+  for (k=1; k<MOM_Len; k++)
+    moments[k]=moments[k]/moments[MOM_NormC];
 }
 
 /**
@@ -411,3 +931,38 @@ void setBounds(Param* param) {
   //param->W2_inf=w2_inf;
 
 }
+
+/**
+ * Set the tomography lines of the first n areas of params, once per data set
+ * (see areaLines in macros.h); also sets caseP.id and caseP.Wbounds
+ * mutates: params, params[0].setP->lines
+ */
+void initAreaLines(Param* params, int n) {
+  int i;
+  caseParam* caseP;
+  areaLines* L=&(params[0].setP->lines);
+  L->n=n;
+  L->W1lb=doubleArray(n); L->W1ub=doubleArray(n);
+  L->W2lb=doubleArray(n); L->W2ub=doubleArray(n);
+  L->m1=doubleArray(n); L->m2=doubleArray(n);
+  L->degenerate=intArray(n);
+  for (i=0; i<n; i++) {
+    caseP=&(params[i].caseP);
+    caseP->id=i;
+    setBounds(&(params[i]));
+    L->W1lb[i]=caseP->Wbounds[0][0]; L->W1ub[i]=caseP->Wbounds[0][1];
+    L->W2lb[i]=caseP->Wbounds[1][0]; L->W2ub[i]=caseP->Wbounds[1][1];
+    L->m1[i]=L->W1ub[i]-L->W1lb[i];
+    L->m2[i]=L->W2lb[i]-L->W2ub[i];
+    L->degenerate[i]=(caseP->Y>=.990 || caseP->Y<=.010);
+  }
+}
+
+/**
+ * Release the arrays held by an areaLines
+ */
+void freeAreaLines(areaLines* L) {
+  Free(L->W1lb); Free(L->W1ub); Free(L->W2lb); Free(L->W2ub);
+  Free(L->m1); Free(L->m2); free(L->degenerate);
+  L->n=0;
+}
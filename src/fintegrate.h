@@ -8,8 +8,15 @@
 
 void NormConstT(double *t, int n, void *param);
 void SuffExp(double *t, int n, void *param);
+void SuffExpAll(double *t, int n, double *out, int nf, void *param);
+int infoParamLen(setParam* setP);
+void InfoExpAll(double *t, int n, double *out, int nf, void *param);
+void InfoHomog(Param* param, double *out, int nf);
+void scoreSuff(setParam* setP, double* suff, double* score);
 double getLogLikelihood(Param* param) ;
+double normCLogLikelihood(Param* param);
 void setNormConst(Param* param);
+void setDensityConst(setParam* setP);
 double getW2starFromW1star(double X, double Y, double W1, int* imposs);
 double getW1starFromW2star(double X, double Y, double W2, int* imposs);
 double getW1FromW2(double X, double Y, double W2);
@@ -17,7 +24,14 @@ double getW1starFromT(double t, Param* param, int* imposs);
 double getW2starFromT(double t, Param* param, int* imposs);
 double getW1starPrimeFromT(double t, Param* param);
 double getW2starPrimeFromT(double t, Param* param);
+void initQuadRule(quadRule* q, int type, int order);
+void freeQuadRule(quadRule* q);
 double paramIntegration(integr_fn f, void *ex);
+int vecParamIntegration(vec_integr_fn f, void *ex, int nf, double *result);
+void setMoments(Param* param, double* moments);
+void printIntegrationError(Param* param);
 void setNormConst(Param* param);
 void setBounds(Param* param);
+void initAreaLines(Param* params, int n);
+void freeAreaLines(areaLines* L);
 
@@ -16,6 +16,7 @@ void cBaseeco(
 	      /*data input */
 	      double *pdX,     /* data (X, Y) */
 	      int *pin_samp,   /* sample size */
+	      double *pdWeight, /* number of identical areas behind each row of pdX (see cUniqueRows) */
 
 	      /*MCMC draws */
 	      int *n_gen,      /* number of gibbs draws */
@@ -59,7 +60,8 @@ void cBaseeco(
 	      double *pdSMu0, double *pdSMu1, 
 	      double *pdSSig00, double *pdSSig01, double *pdSSig11,
            
-	      /* storage for Gibbs draws of W*/
+	      /* storage for Gibbs draws of W: one per area, those of the
+		 areas behind each row of pdX together */
 	      double *pdSW1, double *pdSW2
 	      ){	   
   
@@ -68,7 +70,8 @@ void cBaseeco(
   int s_samp = *sur_samp;    /* sample size of survey data */ 
   int x1_samp = *sampx1;     /* sample size for X=1 */
   int x0_samp = *sampx0;     /* sample size for X=0 */
-  int t_samp = n_samp+s_samp+x1_samp+x0_samp;  /* total sample size */
+  int n_area = 0;            /* rows of W for the n_samp rows of pdX */
+  int t_samp;                /* total sample size */
   int nth = *pinth;  
   int n_dim = 2;             /* dimension */
   int n_step = 1000;         /* 1/The default size of grid step */  
@@ -80,8 +83,8 @@ void cBaseeco(
 
   /* data */
   double **X = doubleMatrix(n_samp, n_dim);       /* The Y and covariates */
-  double **W = doubleMatrix(t_samp, n_dim);       /* The W1 and W2 matrix */
-  double **Wstar = doubleMatrix(t_samp, n_dim);   /* logit tranformed W */       
+  double **W;                                     /* The W1 and W2 matrix */
+  double **Wstar;                                 /* logit tranformed W */       
   double **S_W = doubleMatrix(s_samp, n_dim);     /* The known W1 and W2 matrix*/
   double **S_Wstar = doubleMatrix(s_samp, n_dim); /* logit transformed S_W*/
 
@@ -101,6 +104,25 @@ void cBaseeco(
   int progress = 1, itempP = ftrunc((double) *n_gen/10);
   double dtemp, dtemp1;
 
+  /* identical areas share their row of X and its grid, but each draws
+     its own W; those with Y=0 or 1, whose W is fixed, share one row
+     of W that enters NIWupdate with their number as weight */
+  for (i = 0; i < n_samp; i++)
+    n_area += (pdX[n_samp+i]!=0 && pdX[n_samp+i]!=1) ? (int)pdWeight[i] : 1;
+  t_samp = n_area+s_samp+x1_samp+x0_samp;
+  int *src = intArray(n_area);                   /* row of X of each row of W */
+  double *weight = doubleArray(t_samp);          /* weight of each row of W */
+  for (i = 0, itemp = 0; i < n_samp; i++) {
+    int copies = (pdX[n_samp+i]!=0 && pdX[n_samp+i]!=1) ? (int)pdWeight[i] : 1;
+    for (j = 0; j < copies; j++) {
+      src[itemp] = i;
+      weight[itemp++] = (copies==1) ? pdWeight[i] : 1;
+    }
+  }
+  for (i = n_area; i < t_samp; i++) weight[i] = 1;
+  W = doubleMatrix(t_samp, n_dim);
+  Wstar = doubleMatrix(t_samp, n_dim);
+
   /* get random seed */
   GetRNGstate();
   
@@ -119,16 +141,17 @@ void cBaseeco(
 
 
   /* Initialize W, Wstar for n_samp */
-  for (i=0; i< n_samp; i++) {
-    if (X[i][1]!=0 && X[i][1]!=1) {
-      W[i][0]=runif(minW1[i], maxW1[i]);
-      W[i][1]=(X[i][1]-X[i][0]*W[i][0])/(1-X[i][0]);
+  for (i=0; i< n_area; i++) {
+    k=src[i];
+    if (X[k][1]!=0 && X[k][1]!=1) {
+      W[i][0]=runif(minW1[k], maxW1[k]);
+      W[i][1]=(X[k][1]-X[k][0]*W[i][0])/(1-X[k][0]);
     }
 
-    if (X[i][1]==0) 
+    if (X[k][1]==0) 
       for (j=0; j<n_dim; j++) W[i][j]=0.0001;
 
-    if (X[i][1]==1) 
+    if (X[k][1]==1) 
       for (j=0; j<n_dim; j++) W[i][j]=0.9999;
 
     for (j=0; j<n_dim; j++)
@@ -138,28 +161,28 @@ void cBaseeco(
   /* read homeogenous areas information */
   if (*x1==1) 
     for (i=0; i<x1_samp; i++) {
-      W[(n_samp+i)][0]=x1_W1[i];
+      W[(n_area+i)][0]=x1_W1[i];
 
-      if (W[(n_samp+i)][0]==0) 
-	W[(n_samp+i)][0]=0.0001;
+      if (W[(n_area+i)][0]==0) 
+	W[(n_area+i)][0]=0.0001;
 
-      if (W[(n_samp+i)][0]==1) 
-	W[(n_samp+i)][0]=0.9999;
+      if (W[(n_area+i)][0]==1) 
+	W[(n_area+i)][0]=0.9999;
 
-      Wstar[(n_samp+i)][0]=log(W[(n_samp+i)][0])-log(1-W[(n_samp+i)][0]);
+      Wstar[(n_area+i)][0]=log(W[(n_area+i)][0])-log(1-W[(n_area+i)][0]);
     }
 
   if (*x0==1) 
     for (i=0; i<x0_samp; i++) {
-      W[(n_samp+x1_samp+i)][1]=x0_W2[i];
+      W[(n_area+x1_samp+i)][1]=x0_W2[i];
 
-      if (W[(n_samp+x1_samp+i)][1]==0) 
-	W[(n_samp+x1_samp+i)][1]=0.0001;
+      if (W[(n_area+x1_samp+i)][1]==0) 
+	W[(n_area+x1_samp+i)][1]=0.0001;
       
-      if (W[(n_samp+x1_samp+i)][1]==1) 
-	W[(n_samp+x1_samp+i)][1]=0.9999;
+      if (W[(n_area+x1_samp+i)][1]==1) 
+	W[(n_area+x1_samp+i)][1]=0.9999;
 
-      Wstar[(n_samp+x1_samp+i)][1]=log(W[(n_samp+x1_samp+i)][1])-log(1-W[(n_samp+x1_samp+i)][1]);
+      Wstar[(n_area+x1_samp+i)][1]=log(W[(n_area+x1_samp+i)][1])-log(1-W[(n_area+x1_samp+i)][1]);
     }
 
   /* read the survey data */
@@ -177,8 +200,8 @@ void cBaseeco(
 	  S_W[i][j]=0.9999;
 
 	S_Wstar[i][j]=log(S_W[i][j])-log(1-S_W[i][j]);
-	W[(n_samp+x1_samp+x0_samp+i)][j]=S_W[i][j];
-	Wstar[(n_samp+x1_samp+x0_samp+i)][j]=S_Wstar[i][j];
+	W[(n_area+x1_samp+x0_samp+i)][j]=S_W[i][j];
+	Wstar[(n_area+x1_samp+x0_samp+i)][j]=S_Wstar[i][j];
       }
   }
 
@@ -210,13 +233,14 @@ void cBaseeco(
   for(main_loop=0; main_loop<*n_gen; main_loop++){
     /** update W, Wstar given mu, Sigma in regular areas **/
 
-    for (i=0;i<n_samp;i++){
-      if ( X[i][1]!=0 && X[i][1]!=1 ) {
+    for (i=0;i<n_area;i++){
+      k=src[i];
+      if ( X[k][1]!=0 && X[k][1]!=1 ) {
 
 	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu, InvSigma, n_dim);
+	  rGrid(W[i], W1g[k], W2g[k], n_grid[k], mu, InvSigma, n_dim, NULL);
 	else 
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu, InvSigma, n_dim);
+	  rMH(W[i], X[k], minW1[k], maxW1[k], mu, InvSigma, n_dim, NULL);
       } 
       /*3 compute Wsta_i from W_i*/
       Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
@@ -226,25 +250,25 @@ void cBaseeco(
     /* update W2 given W1, mu and Sigma in x1 homeogeneous areas */
     if (*x1==1)
       for (i=0; i<x1_samp; i++) {
-	dtemp=mu[1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_samp+i][0]-mu[0]);
+	dtemp=mu[1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_area+i][0]-mu[0]);
 	dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
 	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+i][1]=rnorm(dtemp, dtemp1);
-	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
+	Wstar[n_area+i][1]=rnorm(dtemp, dtemp1);
+	W[n_area+i][1]=exp(Wstar[n_area+i][1])/(1+exp(Wstar[n_area+i][1]));
       }
     
     /* update W1 given W2, mu and Sigma in x0 homeogeneous areas */
     if (*x0==1)
       for (i=0; i<x0_samp; i++) {
-	dtemp=mu[0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[1]);
+	dtemp=mu[0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_area+x1_samp+i][1]-mu[1]);
 	dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
 	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+x1_samp+i][0]=rnorm(dtemp, dtemp1);
-	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
+	Wstar[n_area+x1_samp+i][0]=rnorm(dtemp, dtemp1);
+	W[n_area+x1_samp+i][0]=exp(Wstar[n_area+x1_samp+i][0])/(1+exp(Wstar[n_area+x1_samp+i][0]));
       }
     
     /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim);
+    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim, weight, NULL);
     
     /*store Gibbs draw after burn-in and every nth draws */      
     if (main_loop>=*burn_in){
@@ -258,11 +282,12 @@ void cBaseeco(
 	pdSSig11[itempA]=Sigma[1][1];
 	itempA++;
 
-	for(i=0; i<(n_samp+x1_samp+x0_samp); i++){
-	  pdSW1[itempS]=W[i][0];
-	  pdSW2[itempS]=W[i][1];
-	  itempS++;
-	}
+	for(i=0; i<(n_area+x1_samp+x0_samp); i++)
+	  for(j=0; j<(int)weight[i]; j++){
+	    pdSW1[itempS]=W[i][0];
+	    pdSW2[itempS]=W[i][1];
+	    itempS++;
+	  }
 	itempC=0;
       }
     } 
@@ -293,6 +318,8 @@ void cBaseeco(
   FreeMatrix(W1g, n_samp);
   FreeMatrix(W2g, n_samp);
   free(n_grid);
+  free(src);
+  Free(weight);
   Free(mu);
   FreeMatrix(Sigma,n_dim);
   FreeMatrix(InvSigma, n_dim);
@@ -42,7 +42,9 @@ void cBase2C(
 	     int *parameter,  /* 1 if save population parameter */
 	     double *pdSmu, 
 	     double *pdSSigma,
-	     double *pdSW
+	     double *pdSW,
+	     int *pinInner    /* length of the inner Gibbs sampler of
+				 each area, adapted during burn-in */
 	     ){	   
   
   /* some integers */
@@ -64,6 +66,10 @@ void cBase2C(
   double **minU = doubleMatrix(n_samp, n_col);
   double **maxU = doubleMatrix(n_samp, n_col);    
 
+  /* the inner Gibbs sampler of the MH step (see rMH2c) */
+  int *inner = intArray(n_samp);
+  double **innerStat = doubleMatrix(n_samp, 1+3*n_col);
+
   /* model parameters */
   double **Sigma = doubleMatrix(n_col, n_col);    /* The covariance matrix */
   double **InvSigma = doubleMatrix(n_col, n_col); /* The inverse covariance matrix */
@@ -75,11 +81,15 @@ void cBase2C(
   int itempS = 0; /* for Sigma */
   int itempW = 0; /* for W */
   int itempC = 0; /* control nth draw */
+  long nHitRun = 0; /* MH steps where rejection sampling failed */
   int progress = 1, itempP = ftrunc((double) *n_gen/10);
   double dtemp, dtemp1;
   double *param = doubleArray(n_col);   /* Dirichlet parameters */
   double *dvtemp = doubleArray(n_col);
 
+  for (i = 0; i < n_samp; i++)
+    inner[i] = INNER_MaxIter;
+
   /* get random seed */
   GetRNGstate();
   
@@ -149,14 +159,15 @@ void cBase2C(
   for(main_loop = 0; main_loop < *n_gen; main_loop++){
     /** update W, Wstar given mu, Sigma **/
     for (i = 0; i < n_samp; i++){
-      rMH2c(W[i], X[i], Y[i], minU[i], maxU[i], mu, InvSigma, n_col,
-	    *maxit, *reject);
+      nHitRun += rMH2c(W[i], X[i], Y[i], minU[i], maxU[i], mu, InvSigma, n_col,
+		       *maxit, *reject, &inner[i], 
+		       main_loop < *burn_in ? innerStat[i] : NULL);
       for (j = 0; j < n_col; j++) 
 	Wstar[i][j] = log(W[i][j])-log(1-W[i][j]);
     }
     
     /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, n_samp, n_col);
+    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, n_samp, n_col, NULL, NULL);
     
     /*store Gibbs draw after burn-in and every nth draws */      
     if (main_loop>=*burn_in){
@@ -188,6 +199,11 @@ void cBase2C(
 
   /** write out the random seed **/
   PutRNGstate();
+  if (nHitRun > 0)
+    warning("rejection sampling failed after maxit draws in %ld of the updates of W, which used hit-and-run instead", nHitRun);
+
+  for (i = 0; i < n_samp; i++)
+    pinInner[i] = inner[i];
 
   /* Freeing the memory */
   FreeMatrix(S0, n_col);
@@ -200,5 +216,7 @@ void cBase2C(
   FreeMatrix(InvSigma, n_col);
   Free(dvtemp);
   Free(param);
+  Free(inner);
+  FreeMatrix(innerStat, n_samp);
 } /* main */
 
@@ -4,6 +4,9 @@
 #include <Rmath.h>
 #include <R_ext/Utils.h>
 #include <R.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
@@ -29,6 +32,8 @@ void cBaseRC(
 	     int *burn_in,    /* number of draws to be burned in */
 	     int *pinth,      /* keep every nth draw */
 	     int *verbose,    /* 1 for output monitoring */
+	     int *nThreads,   /* number of threads for the update of W;
+				 0 = OpenMP default */
 	     
 	     /* prior specification*/
 	     int *pinu0,      /* prior df parameter for InvWish */
@@ -58,17 +63,20 @@ void cBaseRC(
   int nu0 = *pinu0;                          /* prior degrees of freedom */   
   double **S0 = doubleMatrix(n_col, n_col);  /* prior scale for InvWish */
 
-  /* data */
-  double **Y = doubleMatrix(n_samp, n_dim);               /* Y */
-  double **X = doubleMatrix(n_samp, n_col);               /* X */
-  double ***W = doubleMatrix3D(n_samp, n_dim, n_col);     /* W */
-  double ***Wstar = doubleMatrix3D(n_col, n_samp, n_dim); /* logratio(W) */       
-  double **Wsum = doubleMatrix(n_samp, n_col);            /* sum_{r=1}^{R-1} W_{irc} */
-  double **SWstar = doubleMatrix(n_col, n_dim);
+  /* data and W, kept in one contiguous block per area (see below) */
+  int n_blk = 3*n_dim*n_col + 3*n_col + n_dim;
+  double *pdBlk = doubleArray(n_samp*n_blk);
+  double **Y = Calloc(n_samp, double *);         /* Y */
+  double **X = Calloc(n_samp, double *);         /* X */
+  double ***W = Calloc(n_samp, double **);       /* W */
+  double ***Wstar = Calloc(n_col, double **);    /* logratio(W) */
+  double **Wsum = Calloc(n_samp, double *);      /* sum_{r=1}^{R-1} W_{irc} */
+  double **lpW = Calloc(n_samp, double *);       /* log density of W */
+  double **SWstar;
 
   /* The lower and upper bounds of U = W*X/Y **/
-  double ***minU = doubleMatrix3D(n_samp, n_dim, n_col);
-  double *maxU = doubleArray(n_col);
+  double ***minU = Calloc(n_samp, double **);
+  double *maxU;
 
   /* model parameters */
   double **mu = doubleMatrix(n_col, n_dim);                 /* mean */
@@ -82,11 +90,50 @@ void cBaseRC(
   int itempS = 0;           /* for Sigma */
   int itempW = 0;           /* for W */
   int itempC = 0;           /* control nth draw */
+  long nHitRun = 0;         /* MH steps where rejection sampling failed */
   int progress = 1, itempP = ftrunc((double) *n_gen/10);
   double dtemp, dtemp1;
   double *param = doubleArray(n_col);   /* Dirichlet parameters */
-  double *dvtemp = doubleArray(n_col);
-  double *dvtemp1 = doubleArray(n_col);
+  double *dvtemp, *dvtemp1, *dvtemp2;
+
+  /* the scratch of each thread, and the random number stream of each
+     area (see rngUnif) for the update of W */
+#ifdef _OPENMP
+  int n_threads = *nThreads > 0 ? *nThreads : omp_get_max_threads();
+#else
+  int n_threads = 1;
+#endif
+  double **thMaxU = doubleMatrix(n_threads, n_col);
+  double **thDvtemp = doubleMatrix(n_threads, n_col);
+  double **thDvtemp1 = doubleMatrix(n_threads, n_col);
+  double **thDvtemp2 = doubleMatrix(n_threads, n_col);
+  double ***thSWstar = doubleMatrix3D(n_threads, n_col, n_dim);
+  unsigned long long *stream = Calloc(n_samp, unsigned long long);
+  /* and the stream and the status (see NIWupdate) of each column for
+     the update of mu and Sigma */
+  unsigned long long *colStream = Calloc(n_col, unsigned long long);
+  int *colStatus = intArray(n_col);
+
+  /* the block of area i holds W[i] (n_dim x n_col), minU[i] (n_dim x
+     n_col), Wstar[.][i] (n_col x n_dim), Wsum[i], lpW[i], X[i] and
+     Y[i], so that its update stays in cache; Wstar[k] is the view of
+     column k over the areas that NIWupdate takes */
+  for (k = 0; k < n_col; k++)
+    Wstar[k] = Calloc(n_samp, double *);
+  for (i = 0; i < n_samp; i++) {
+    W[i] = Calloc(n_dim, double *);
+    minU[i] = Calloc(n_dim, double *);
+    for (j = 0; j < n_dim; j++) {
+      W[i][j] = pdBlk + i*n_blk + j*n_col;
+      minU[i][j] = pdBlk + i*n_blk + (n_dim+j)*n_col;
+    }
+    for (k = 0; k < n_col; k++)
+      Wstar[k][i] = pdBlk + i*n_blk + 2*n_dim*n_col + k*n_dim;
+    Wsum[i] = pdBlk + i*n_blk + 3*n_dim*n_col;
+    lpW[i] = Wsum[i] + n_col;
+    X[i] = lpW[i] + n_col;
+    Y[i] = X[i] + n_col;
+  }
 
   /* get random seed */
   GetRNGstate();
@@ -124,6 +171,7 @@ void cBaseRC(
     dinv(Sigma[k], n_dim, InvSigma[k]);
   
   /* initial values for W */
+  dvtemp = thDvtemp[0];
   for (k = 0; k < n_col; k++)
     param[k] = 1.0;
   for (i = 0; i < n_samp; i++) {
@@ -173,67 +221,112 @@ void cBaseRC(
     for(j = 0; j < n_dim; j++) 
       S0[j][k] = pdS0[itemp++];
 
+  for (i = 0; i < n_samp; i++)
+    rngSeed(&stream[i]);
+  for (k = 0; k < n_col; k++)
+    rngSeed(&colStream[k]);
+
   /*** Gibbs sampler! ***/
   if (*verbose)
     Rprintf("Starting Gibbs sampler...\n");
   for(main_loop = 0; main_loop < *n_gen; main_loop++){
     /** update W, Wstar given mu, Sigma **/
+    /* areas are independent given mu and Sigma: each area draws from its
+       own stream, so the draws do not depend on the number of threads */
+#ifdef _OPENMP
+#pragma omp parallel for private(j,k,l,itemp,dtemp,dtemp1,maxU,dvtemp,dvtemp1,dvtemp2,SWstar) reduction(+:nHitRun) schedule(dynamic,8) num_threads(n_threads)
+#endif
     for (i = 0; i < n_samp; i++) {
+#ifdef _OPENMP
+      maxU = thMaxU[omp_get_thread_num()];
+      dvtemp = thDvtemp[omp_get_thread_num()];
+      dvtemp1 = thDvtemp1[omp_get_thread_num()];
+      dvtemp2 = thDvtemp2[omp_get_thread_num()];
+      SWstar = thSWstar[omp_get_thread_num()];
+#else
+      maxU = thMaxU[0]; dvtemp = thDvtemp[0];
+      dvtemp1 = thDvtemp1[0]; dvtemp2 = thDvtemp2[0];
+      SWstar = thSWstar[0];
+#endif
+      /* the log density of the current W of each column, up to the
+	 terms of the row being updated */
+      for (k = 0; k < n_col; k++)
+	lpW[i][k] = dMVNkern(Wstar[k][i], mu[k], InvSigma[k], n_dim)
+	  - log(1-Wsum[i][k]);
       /* sampling W through Metropolis Step for each row */
       for (j = 0; j < n_dim; j++) {
 	/* computing upper bounds for U */
-	for (k = 0; k < n_col; k++) {
-	  Wsum[i][k] -= W[i][j][k];
-	  maxU[k] = fmin2(1, X[i][k]*(1-Wsum[i][k])/Y[i][j]);
-	}
+	for (k = 0; k < n_col; k++)
+	  maxU[k] = fmin2(1, X[i][k]*(1-Wsum[i][k]+W[i][j][k])/Y[i][j]);
 	/** MH step **/
-	/* Sample a candidate draw of W from truncated Dirichlet */
+	/* Sample a candidate draw of W from truncated Dirichlet(1),
+	   i.e. normalised exponentials */
 	l = 0; itemp = 1;
-	while (itemp > 0) {
-	  rDirich(dvtemp, param, n_col);
-	  itemp = 0;
-	  for (k = 0; k < n_col; k++) 
-	    if (dvtemp[k] > maxU[k] || dvtemp[k] < minU[i][j][k])
-	      itemp++;
-	  l++;
-	  if (l > *maxit)
-	    error("rejection algorithm failed because bounds are too tight.\n increase maxit or use gibbs sampler instead.");
+	if (*reject)
+	  while (itemp > 0 && l < *maxit) {
+	    dtemp = 0;
+	    for (k = 0; k < n_col; k++) {
+	      dvtemp[k] = -log(rngUnif(&stream[i]));
+	      dtemp += dvtemp[k];
+	    }
+	    itemp = 0;
+	    for (k = 0; k < n_col; k++) {
+	      dvtemp[k] /= dtemp;
+	      if (dvtemp[k] > maxU[k] || dvtemp[k] < minU[i][j][k])
+		itemp++;
+	    }
+	    l++;
+	  }
+	/* or move the current draw by hit-and-run on the bounded
+	   simplex, also when the rejection sampling fails */
+	if (itemp > 0) {
+	  if (*reject)
+	    nHitRun++;
+	  for (k = 0; k < n_col; k++)
+	    dvtemp[k] = W[i][j][k]*X[i][k]/Y[i][j];
+	  rHitRun(dvtemp, minU[i][j], maxU, dvtemp1, n_col, n_col, &stream[i]);
 	}
-	/* get W and its log-ratio transformation */
+	/* get W, its log-ratio transformation and its log density,
+	   with the Jacobian terms of row j and of the last row */
+	dtemp = 0; dtemp1 = 0;
 	for (k = 0; k < n_col; k++) {
 	  dvtemp[k] = dvtemp[k]*Y[i][j]/X[i][k];
-	  dvtemp1[k] = Wsum[i][k]+dvtemp[k];
-	}
-	for (k = 0; k < n_col; k++) 
+	  dvtemp1[k] = Wsum[i][k]-W[i][j][k]+dvtemp[k];
 	  for (l = 0; l < n_dim; l++) 
 	    if (l == j)
 	      SWstar[k][l] = log(dvtemp[k])-log(1-dvtemp1[k]);
 	    else
-	      SWstar[k][l] = log(W[i][j][k])-log(1-dvtemp1[k]);
-	/* computing acceptance ratio */
-	dtemp = 0; dtemp1 = 0;
-	for (k= 0; k < n_col; k++) {
-	  dtemp += dMVN(SWstar[k], mu[k], InvSigma[k], n_dim, 1);
-	  dtemp1 += dMVN(Wstar[k][i], mu[k], InvSigma[k], n_dim, 1);
-	  dtemp -= log(dvtemp[k]);
-	  dtemp1 -= log(W[i][j][k]);
+	      SWstar[k][l] = log(W[i][l][k])-log(1-dvtemp1[k]);
+	  dvtemp2[k] = dMVNkern(SWstar[k], mu[k], InvSigma[k], n_dim)
+	    - log(1-dvtemp1[k]);
+	  dtemp += dvtemp2[k]-log(dvtemp[k]);
+	  dtemp1 += lpW[i][k]-log(W[i][j][k]);
 	}
-	if (unif_rand() < fmin2(1, exp(dtemp-dtemp1))) 
-	  for (k = 0; k < n_col; k++)
+	/* accept, and update Wsum, Wstar and their densities */
+	if (rngUnif(&stream[i]) < fmin2(1, exp(dtemp-dtemp1))) 
+	  for (k = 0; k < n_col; k++) {
 	    W[i][j][k] = dvtemp[k]; 
-	/* updating Wsum and Wstar with new draws */
-	for (k = 0; k < n_col; k++) {
-	  Wsum[i][k] += W[i][j][k];
-	  for (l = 0; l < n_dim; l++) 
-	    Wstar[k][i][l] = log(W[i][l][k])-log(1-Wsum[i][k]);
-	}
+	    Wsum[i][k] = dvtemp1[k];
+	    lpW[i][k] = dvtemp2[k];
+	    for (l = 0; l < n_dim; l++) 
+	      Wstar[k][i][l] = SWstar[k][l];
+	  }
       }
     }    
     
-    /* update mu, Sigma given wstar using effective sample of Wstar */
+    /* update mu, Sigma given wstar using effective sample of Wstar;
+       the columns are independent given W, each with its own stream */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+#endif
+    for (k = 0; k < n_col; k++)
+      colStatus[k] = NIWupdate(Wstar[k], mu[k], Sigma[k], InvSigma[k], mu0,
+			       tau0, nu0, S0, n_samp, n_dim, NULL,
+			       &colStream[k]);
     for (k = 0; k < n_col; k++)
-      NIWupdate(Wstar[k], mu[k], Sigma[k], InvSigma[k], mu0, tau0,
-		nu0, S0, n_samp, n_dim); 
+      if (colStatus[k])
+	error("cBaseRC: Sigma of column %d is not positive definite. Error code %d\n",
+	      k+1, colStatus[k]);
     
     /*store Gibbs draw after burn-in and every nth draws */     
     if (main_loop >= *burn_in){
@@ -267,19 +360,36 @@ void cBaseRC(
 
   /** write out the random seed **/
   PutRNGstate();
+  if (nHitRun > 0)
+    warning("rejection sampling failed after maxit draws in %ld of the updates of W, which used hit-and-run instead", nHitRun);
 
   /* Freeing the memory */
   FreeMatrix(S0, n_col);
-  FreeMatrix(X, n_samp);
-  FreeMatrix(Y, n_samp);
-  Free3DMatrix(W, n_samp, n_dim);
-  Free3DMatrix(Wstar, n_col, n_samp);
-  FreeMatrix(Wsum, n_samp);
-  Free3DMatrix(minU, n_samp, n_dim);
+  for (i = 0; i < n_samp; i++) {
+    Free(W[i]);
+    Free(minU[i]);
+  }
+  for (k = 0; k < n_col; k++)
+    Free(Wstar[k]);
+  Free(X);
+  Free(Y);
+  Free(W);
+  Free(Wstar);
+  Free(Wsum);
+  Free(lpW);
+  Free(minU);
+  Free(pdBlk);
   FreeMatrix(mu, n_col);
   Free3DMatrix(Sigma, n_col, n_dim);
   Free3DMatrix(InvSigma, n_col, n_dim);
   Free(param);
-  Free(dvtemp);
+  FreeMatrix(thMaxU, n_threads);
+  FreeMatrix(thDvtemp, n_threads);
+  FreeMatrix(thDvtemp1, n_threads);
+  FreeMatrix(thDvtemp2, n_threads);
+  Free3DMatrix(thSWstar, n_threads, n_col);
+  Free(stream);
+  Free(colStream);
+  free(colStatus);
 } /* main */
 
@@ -267,9 +267,9 @@ void cDPeco(
     for (i=0;i<n_samp;i++){
       if (X[i][1]!=0 && X[i][1]!=1) {
 	if (*Grid) 
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma[i], n_dim);
+	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma[i], n_dim, NULL);
 	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu[i], InvSigma[i], n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu[i], InvSigma[i], n_dim, NULL);
       }
 
       /*3 compute Wsta_i from W_i*/
@@ -327,7 +327,7 @@ void cDPeco(
       onedata[0][0] = Wstar[i][0];
       onedata[0][1] = Wstar[i][1];
 
-      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim);
+      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim, NULL, NULL);
       C[i]=nstar;
       nstar++;
     }
@@ -376,7 +376,7 @@ void cDPeco(
 
     
     /** posterior update for mu_mix, Sigma_mix based on Psimix **/
-    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, n_dim);     
+    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, n_dim, NULL, NULL);     
     
 
     /**update mu, Simgat with mu_mix, Sigmat_mix via label**/
@@ -4,6 +4,9 @@
 #include <R.h>
 #include <Rmath.h>
 #include <R_ext/PrtUtil.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
@@ -13,18 +16,37 @@
 #include "fintegrate.h"
 
 
-void readData(Param* params, int n_dim, double* pdX, double* sur_W, double* x1_W1, double* x0_W2,
+int ecoEMFit(setParam* setP, int quiet, double *pdX, double *pdTheta_in, int *pin_samp, double *pdWeight,
+             int *iteration_max, double *convergence, int *survey, int *sur_samp, double *sur_W,
+             int *x1, int *sampx1, double *x1_W1, int *x0, int *sampx0, double *x0_W2,
+             double *minW1, double *maxW1, int *flag, int *verbosiosity, int *calcLoglik, int *hypTest_L,
+             int *quadType, int *quadOrder, int *nThreads, int *accelerate, int *louis, int *historyEvery,
+             int *optimizer, int *batchSize, int *batchPasses, double *optTheta,
+             double *pdTheta, double *Suff, double *inSample, double *DMmatrix, int *itersUsed,
+             double *history, int *historyRows, double *Imiss);
+void readData(Param* params, int n_dim, double* pdX, double* pdWeight, double* sur_W, double* x1_W1, double* x0_W2,
                 int n_samp, int s_samp, int x1_samp, int x0_samp);
 void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7]);
 void ecoEStep(Param* params, double* suff);
+void ecoEMStep(Param* params, double* Suff, double* pdTheta);
+void ecoMissingInfo(Param* params, double* Imiss);
+void ecoSQUAREM(Param* params, double* Suff, double* pdTheta, double* stepMax);
+int ecoLBFGS(Param* params, double* Suff, double* pdTheta, double* t_pdTheta, int iteration_max, double* history);
+void ecoIncrementalEM(Param* params, double* pdTheta, int batchSize, int passes);
 void ecoMStep(double* Suff, double* pdTheta, Param* params);
 void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params);
 void ecoMStepCCAR(double* pdTheta, Param* params);
 void MStepHypTest(Param* params, double* pdTheta);
 void initTheta(double* pdTheta_in,Param* params, double* pdTheta);
 void initNCAR(Param* params, double* pdTheta);
-void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][10]);
+void setParamsFromTheta(Param* params, double* pdTheta);
+void sigmaInv(setParam* setP, double* Sigma, int size, double* InvSigma, char* emsg);
+void thetaToAccel(double* pdTheta, double* a_pdTheta, setParam* setP);
+void accelToTheta(double* a_pdTheta, double* pdTheta, setParam* setP);
+int validTheta(double* pdTheta, setParam* setP);
+void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double* history);
 int closeEnough(double* pdTheta, double* pdTheta_old, int len, double maxerr);
+double ecoIntTol(double* t_pdTheta, double* t_pdTheta_old, int len);
 int semDoneCheck(setParam* setP);
 void gridEStep(Param* params, int n_samp, int s_samp, int x1_samp, int x0_samp, double* suff, int verbose, double minW1, double maxW1);
 void transformTheta(double* pdTheta, double* t_pdTheta, int len, setParam* setP);
@@ -35,7 +57,7 @@ void printColumnHeader(int main_loop, int iteration_max, setParam* setP, int fin
 
 /**
  * Main function.
- * Important mutations (i.e., outputs): pdTheta, Suff, DMmatrix, history
+ * Important mutations (i.e., outputs): pdTheta, Suff, DMmatrix, history, Imiss
  * See internal comments for details.
  */
 
@@ -46,6 +68,7 @@ void cEMeco(
 				    CAR: mu1, mu2, var1, var2, rho
 				    NCAR: mu1, mu2, var1, var2, p13,p13,p12*/
 	    int *pin_samp,       /* sample size */
+	    double *pdWeight,    /* number of identical areas behind each row of pdX (see cUniqueRows) */
 
 	    /* loop vairables */
 	    int *iteration_max,          /* number of maximum iterations */
@@ -76,6 +99,15 @@ void cEMeco(
 	    int *verbosiosity,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
       int *calcLoglik,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
 	    int *hypTest_L,   /* number of hypothesis constraints */
+	    int *quadType,    /* integration backend: 0=adaptive (Rdqags), 1=Gauss-Legendre, 2=tanh-sinh */
+	    int *quadOrder,   /* Gauss-Legendre nodes or tanh-sinh level; ignored when adaptive */
+	    int *nThreads,    /* number of threads for the E-step; 0 = OpenMP default */
+	    int *accelerate,  /* 1 = SQUAREM acceleration of the EM iterations (ignored in the second SEM run) */
+	    int *louis,       /* 1 = compute the missing information by Louis' method at the final theta */
+	    int *historyEvery, /* record the history of every k-th iteration (the last one is always recorded) */
+	    int *optimizer,   /* 0 = EM, 1 = L-BFGS on the log-likelihood (ignored in the second SEM run) */
+	    int *batchSize,   /* areas per block of the incremental EM run first; 0 = none (ignored in the second SEM run) */
+	    int *batchPasses, /* number of passes of the incremental EM through the areas */
 	    double *optTheta,  /*optimal theta obtained from previous EM result; if set, then we're doing SEM*/
 
 	    /* storage */
@@ -87,47 +119,159 @@ void cEMeco(
       double *inSample, /* In Sample info */
       double *DMmatrix,  /* DM matrix for SEM*/
       int *itersUsed, /* number of iterations used */
-      double *history /* history of param (transformed) as well as logliklihood*/
+      double *history, /* history of param (transformed) as well as logliklihood, param_len+1 per row;
+                          at least iteration_max/historyEvery+2 rows */
+      int *historyRows, /* number of rows of history filled */
+      double *Imiss /* missing information (Louis' method), param_len x param_len by rows */
+	    ){
+  setParam setP;
+  if (*hypTest_L>1) error("Unable to do hypothesis testing with more than one constraint");
+  initQuadRule(&setP.quad,*quadType,*quadOrder);
+
+  /* get random seed */
+  GetRNGstate();
+  ecoEMFit(&setP,0,pdX,pdTheta_in,pin_samp,pdWeight,iteration_max,convergence,survey,sur_samp,sur_W,x1,sampx1,x1_W1,x0,sampx0,x0_W2,minW1,maxW1,flag,verbosiosity,calcLoglik,hypTest_L,quadType,quadOrder,nThreads,accelerate,louis,historyEvery,optimizer,batchSize,batchPasses,optTheta,pdTheta,Suff,inSample,DMmatrix,itersUsed,history,historyRows,Imiss);
+  /* write out the random seed */
+  PutRNGstate();
+  freeQuadRule(&setP.quad);
+}
+
+/**
+ * The fit of cEMeco, with setP supplied by the caller and its quadrature rule
+ * (setP->quad) already set. With quiet set the fit may run off the main thread
+ * (see cEMecoBatch): it then prints nothing, neither checks for interrupts nor uses
+ * R's RNG (no incremental EM), and reports failures through its return value instead
+ * of error(); a singular Sigma leaves its LAPACK code in setP->invErr (see sigmaInv).
+ * The caller sets up R's RNG when not quiet.
+ * returns: FIT_OK, or the failure of a quiet fit (see e_fit_status)
+ */
+int ecoEMFit(setParam* setP, int quiet,
+
+	    /*data input */
+	    double *pdX,         /* data (X, Y) */
+	    double *pdTheta_in,  /* Theta^ t
+				    CAR: mu1, mu2, var1, var2, rho
+				    NCAR: mu1, mu2, var1, var2, p13,p13,p12*/
+	    int *pin_samp,       /* sample size */
+	    double *pdWeight,    /* number of identical areas behind each row of pdX (see cUniqueRows) */
+
+	    /* loop vairables */
+	    int *iteration_max,          /* number of maximum iterations */
+	    double *convergence,          /* abs value limit before stopping */
+
+	    /*incorporating survey data */
+	    int *survey,         /*1 if survey data available(W_1, W_2)
+				   0 not*/
+	    int *sur_samp,       /*sample size of survey data*/
+	    double *sur_W,       /*set of known W_1, W_2 */
+
+	    /*incorporating homeogenous areas */
+	    int *x1,       /* 1 if X=1 type areas available W_1 known,
+			      W_2 unknown */
+	    int *sampx1,   /* number X=1 type areas */
+	    double *x1_W1, /* values of W_1 for X1 type areas */
+
+	    int *x0,       /* 1 if X=0 type areas available W_2 known,
+			      W_1 unknown */
+	    int *sampx0,   /* number X=0 type areas */
+	    double *x0_W2, /* values of W_2 for X0 type areas */
+
+	    /* bounds of W1 */
+	    double *minW1, double *maxW1,
+
+	    /* options */
+	    int *flag,    /*0th (rightmost) bit: 1 = NCAR, 0=normal; 1st bit: 1 = fixed rho, 0 = not fixed rho*/
+	    int *verbosiosity,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
+      int *calcLoglik,    /*How much to print out, 0=silent, 1=cycle, 2=data*/
+	    int *hypTest_L,   /* number of hypothesis constraints */
+	    int *quadType,    /* integration backend: 0=adaptive (Rdqags), 1=Gauss-Legendre, 2=tanh-sinh */
+	    int *quadOrder,   /* Gauss-Legendre nodes or tanh-sinh level; ignored when adaptive */
+	    int *nThreads,    /* number of threads for the E-step; 0 = OpenMP default */
+	    int *accelerate,  /* 1 = SQUAREM acceleration of the EM iterations (ignored in the second SEM run) */
+	    int *louis,       /* 1 = compute the missing information by Louis' method at the final theta */
+	    int *historyEvery, /* record the history of every k-th iteration (the last one is always recorded) */
+	    int *optimizer,   /* 0 = EM, 1 = L-BFGS on the log-likelihood (ignored in the second SEM run) */
+	    int *batchSize,   /* areas per block of the incremental EM run first; 0 = none (ignored in the second SEM run) */
+	    int *batchPasses, /* number of passes of the incremental EM through the areas */
+	    double *optTheta,  /*optimal theta obtained from previous EM result; if set, then we're doing SEM*/
+
+	    /* storage */
+      //Theta under CAR: mu1,mu2,s1,s2,p12
+      //Theta under NCAR: mu_3, mu_1, mu_2, sig_3, sig_1, sig_2, r_13, r_23, r_12
+	    double *pdTheta,  /*EM result for Theta^(t+1) */
+	    double *Suff,      /*out put suffucient statistics (E(W_1i|Y_i),
+				E(E_1i*W_1i|Y_i..) when  conveges */
+      double *inSample, /* In Sample info */
+      double *DMmatrix,  /* DM matrix for SEM*/
+      int *itersUsed, /* number of iterations used */
+      double *history, /* history of param (transformed) as well as logliklihood, param_len+1 per row;
+                          at least iteration_max/historyEvery+2 rows */
+      int *historyRows, /* number of rows of history filled */
+      double *Imiss /* missing information (Louis' method), param_len x param_len by rows */
 	    ){
 
   int n_samp  = *pin_samp;    /* sample size */
   int s_samp  = *survey ? *sur_samp : 0;     /* sample size of survey data */
   int x1_samp = *x1 ? *sampx1 : 0;       /* sample size for X=1 */
   int x0_samp = *x0 ? *sampx0 : 0;       /* sample size for X=0 */
-  //int t_samp=n_samp+s_samp+x1_samp+x0_samp;  /* total sample size*/
-  int t_samp=n_samp+s_samp;  /* total sample size, ignoring homog data*/
+  int t_samp;  /* total sample size*/
   int n_dim=2;        /* dimensions */
 
-  setParam setP;
   //set options
-  setP.ncar=bit(*flag,0);
-  setP.fixedRho=bit(*flag,1);
-  setP.sem=bit(*flag,2) & (optTheta[2]!=-1.1);
-  setP.ccar=0; setP.ccar_nvar=0;
+  setP->ncar=bit(*flag,0);
+  setP->fixedRho=bit(*flag,1);
+  setP->sem=bit(*flag,2) & (optTheta[2]!=-1.1);
+  setP->ccar=0; setP->ccar_nvar=0;
+  //X=0 or 1 has no density under NCAR, where X is modeled
+  if (setP->ncar && (x1_samp+x0_samp)>0) {
+    if (!quiet) Rprintf("WARNING: Homogenous data is ignored under NCAR.\n");
+    x1_samp=x0_samp=0;
+  }
+  t_samp=n_samp+s_samp+x1_samp+x0_samp;
 
   //hard-coded hypothesis test
   //hypTest is the number of constraints.  hyptTest==0 when we're not checking a hypothesis
-  setP.hypTest=(*hypTest_L);
-  if (setP.hypTest>1) error("Unable to do hypothesis testing with more than one constraint");
-  if (setP.hypTest==1) {
-    setP.hypTestCoeff=doubleMatrix(setP.ncar ? 3 : 2,setP.hypTest);
-    setP.hypTestCoeff[0][0]=1; setP.hypTestCoeff[1][0]=-1;
-    if (setP.ncar) setP.hypTestCoeff[2][0]=0;
-    setP.hypTestResult=0;
-  }
-
-  setP.verbose=*verbosiosity;
-  if (setP.verbose>=1) Rprintf("OPTIONS::  Ncar: %s; Fixed Rho: %s; SEM: %s\n",setP.ncar==1 ? "Yes" : "No",
-   setP.fixedRho==1 ? "Yes" : "No",setP.sem==1 ? "Second run" : (bit(*flag,2)==1 ? "First run" : "No"));
-  setP.calcLoglik=*calcLoglik;
-  setP.convergence=*convergence;
-  setP.t_samp=t_samp; setP.n_samp=n_samp; setP.s_samp=s_samp; setP.x1_samp=x1_samp; setP.x0_samp=x0_samp;
-  int param_len=setP.ccar ? setP.ccar_nvar : (setP.ncar ? 9 : 5);
-  setP.param_len=param_len;
-  setP.pdTheta=doubleArray(param_len);
-  setP.suffstat_len=(setP.ncar ? 9 : 5);
-  setP.SigmaK=doubleMatrix(param_len,param_len); //CCAR
-  setP.InvSigmaK=doubleMatrix(param_len,param_len); //CCAR
+  setP->hypTest=(*hypTest_L);
+  if (setP->hypTest==1) {
+    setP->hypTestCoeff=doubleMatrix(setP->ncar ? 3 : 2,setP->hypTest);
+    setP->hypTestCoeff[0][0]=1; setP->hypTestCoeff[1][0]=-1;
+    if (setP->ncar) setP->hypTestCoeff[2][0]=0;
+    setP->hypTestResult=0;
+  }
+
+  setP->threads=*nThreads;
+  //L-BFGS replaces the EM iterations of the first run; SEM differentiates the EM map
+  int useLBFGS=(*optimizer==1) && !setP->sem;
+  if (useLBFGS && (setP->hypTest>0 || (setP->ncar && setP->fixedRho))) {
+    if (!quiet) Rprintf("WARNING: L-BFGS is not available for hypothesis tests or NCAR with fixed rho; using EM.\n");
+    useLBFGS=0;
+  }
+  setP->accel=*accelerate && !setP->sem && !useLBFGS;
+  //incremental EM on blocks of areas ahead of the full iterations; it draws on R's RNG
+  int useIncremental=(*batchSize>0) && (*batchSize<t_samp) && (*batchPasses>0) && !setP->sem && !quiet;
+  if (useIncremental && (setP->hypTest>0 || (setP->ncar && setP->fixedRho))) {
+    if (!quiet) Rprintf("WARNING: incremental EM is not available for hypothesis tests or NCAR with fixed rho; skipped.\n");
+    useIncremental=0;
+  }
+  setP->quiet=quiet; setP->invErr=0;
+  setP->historyEvery=(*historyEvery>0) ? *historyEvery : 1;
+  setP->historyRows=0;
+  //SEM differentiates the EM map, so its iterations are always at full precision
+  setP->intTol=(setP->sem || useLBFGS) ? INT_Tol : ecoIntTol(NULL,NULL,0);
+  double lastTol=setP->intTol; //tolerance of the E-step of the last iteration
+
+  setP->verbose=quiet ? 0 : *verbosiosity;
+  if (setP->verbose>=1) Rprintf("OPTIONS::  Ncar: %s; Fixed Rho: %s; SEM: %s\n",setP->ncar==1 ? "Yes" : "No",
+   setP->fixedRho==1 ? "Yes" : "No",setP->sem==1 ? "Second run" : (bit(*flag,2)==1 ? "First run" : "No"));
+  setP->calcLoglik=(setP->accel || useLBFGS) ? 1 : *calcLoglik; //SQUAREM and L-BFGS need the log-likelihood
+  setP->convergence=*convergence;
+  setP->t_samp=t_samp; setP->n_samp=n_samp; setP->s_samp=s_samp; setP->x1_samp=x1_samp; setP->x0_samp=x0_samp;
+  int param_len=setP->ccar ? setP->ccar_nvar : (setP->ncar ? 9 : 5);
+  setP->param_len=param_len;
+  setP->pdTheta=doubleArray(param_len);
+  setP->suffstat_len=(setP->ncar ? 9 : 5);
+  setP->SigmaK=doubleMatrix(param_len,param_len); //CCAR
+  setP->InvSigmaK=doubleMatrix(param_len,param_len); //CCAR
 
   /* model parameters */
   //double **Sigma=doubleMatrix(n_dim,n_dim);/* inverse covariance matrix*/
@@ -138,91 +282,89 @@ void cEMeco(
   double *t_pdTheta_old=doubleArray(param_len);
   double Rmat_old[7][7];
   double Rmat[7][7];
-  double history_full[*iteration_max+1][10];
+  double stepMax=1; //SQUAREM maximum step length
 
   /* misc variables */
   int i, j,main_loop, start;   /* used for various loops */
-
-  /* get random seed */
-  GetRNGstate();
+  int status=FIT_OK;
 
   //assign param
-  Param* params=(Param*) R_alloc(t_samp,sizeof(Param));
+  Param* params=(Param*) Calloc(t_samp,Param);
 
-  for(i=0;i<t_samp;i++) params[i].setP=&setP;
-  readData(params, n_dim, pdX, sur_W, x1_W1, x0_W2, n_samp, s_samp, x1_samp, x0_samp);
+  for(i=0;i<t_samp;i++) params[i].setP=setP;
+  readData(params, n_dim, pdX, pdWeight, sur_W, x1_W1, x0_W2, n_samp, s_samp, x1_samp, x0_samp);
 
 
 
   /***Begin main loop ***/
   main_loop=1;start=1;
-  while (main_loop<=*iteration_max && (start==1 ||
-          (setP.sem==0 && !closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence)) ||
-          (setP.sem==1 && !semDoneCheck((setParam*)&setP)))) {
+  if (useLBFGS) {
+    initTheta(pdTheta_in,params,pdTheta);
+    transformTheta(pdTheta,t_pdTheta,param_len, setP);
+    setHistory(t_pdTheta,0,0,setP,history);
+    if (useIncremental) ecoIncrementalEM(params,pdTheta,*batchSize,*batchPasses);
+    setParamsFromTheta(params,pdTheta);
+    main_loop=ecoLBFGS(params,Suff,pdTheta,t_pdTheta,*iteration_max,history)+1;
+    if (main_loop==0) status=FIT_BadStart;
+  }
+  while (!useLBFGS && !setP->invErr && main_loop<=*iteration_max && (start==1 ||
+          (setP->sem==0 && (!closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence) || lastTol>INT_Tol)) ||
+          (setP->sem==1 && !semDoneCheck(setP)))) {
   //while (main_loop<=*iteration_max && (start==1 || !closeEnough(transformTheta(pdTheta),transformTheta(pdTheta_old),param_len,*convergence))) {
 
-    setP.iter=main_loop;
+    setP->iter=main_loop;
     if (start) {
       initTheta(pdTheta_in,params,pdTheta);
-      transformTheta(pdTheta,t_pdTheta,param_len, &setP);
-      setHistory(t_pdTheta,0,0,(setParam*)&setP,history_full);
-      if (!setP.ncar) {
-        for(i=0;i<t_samp;i++) {
-          params[i].caseP.mu[0] = pdTheta[0];
-          params[i].caseP.mu[1] = pdTheta[1];
-        }
-        setP.Sigma[0][0] = pdTheta[2];
-        setP.Sigma[1][1] = pdTheta[3];
-        setP.Sigma[0][1] = pdTheta[4]*sqrt(pdTheta[2]*pdTheta[3]);
-        setP.Sigma[1][0] = setP.Sigma[0][1];
-        dinv2D((double*)&setP.Sigma[0][0], 2, (double*)&setP.InvSigma[0][0], "Start of main loop");
-      }
-      else {
-        if (setP.fixedRho) ncarFixedRhoTransform(pdTheta);
-        initNCAR(params,pdTheta);
-        if (setP.fixedRho) ncarFixedRhoUnTransform(pdTheta);
-      }
+      transformTheta(pdTheta,t_pdTheta,param_len, setP);
+      setHistory(t_pdTheta,0,0,setP,history);
+      if (useIncremental) ecoIncrementalEM(params,pdTheta,*batchSize,*batchPasses);
+      setParamsFromTheta(params,pdTheta);
       start=0;
     }
-    for(i=0;i<param_len;i++) setP.pdTheta[i]=pdTheta[i];
+    for(i=0;i<param_len;i++) setP->pdTheta[i]=pdTheta[i];
 
-    if (setP.verbose>=1) {
-      if ((main_loop - 1) % 15 == 0) printColumnHeader(main_loop,*iteration_max,&setP,0);
+    if (setP->verbose>=1) {
+      if ((main_loop - 1) % 15 == 0) printColumnHeader(main_loop,*iteration_max,setP,0);
 
       Rprintf("cycle %d/%d:",main_loop,*iteration_max);
       for(i=0;i<param_len;i++)
-        if (setP.varParam[i]) {
+        if (setP->varParam[i]) {
           if (pdTheta[i]>=0) Rprintf("% 5.3f",pdTheta[i]);
           else Rprintf(" % 5.2f",pdTheta[i]);
         }
-      if (setP.calcLoglik==1 && main_loop>2)
-        Rprintf(" Prev LL: %5.2f",Suff[setP.suffstat_len]);
+      if (setP->calcLoglik==1 && main_loop>2)
+        Rprintf(" Prev LL: %5.2f",Suff[setP->suffstat_len]);
       Rprintf("\n");
     }
     //keep the old theta around for comaprison
     for(i=0;i<param_len;i++) pdTheta_old[i]=pdTheta[i];
-    transformTheta(pdTheta_old,t_pdTheta_old,param_len,&setP);
+    transformTheta(pdTheta_old,t_pdTheta_old,param_len,setP);
 
 
-    ecoEStep(params, Suff);
-    if (!setP.ncar)
-      ecoMStep(Suff,pdTheta,params);
+    //the first cycle is a plain EM step: the E-step has no log-likelihood to guard SQUAREM with yet
+    if (setP->accel && main_loop>1)
+      ecoSQUAREM(params,Suff,pdTheta,&stepMax);
     else
-      ecoMStepNCAR(Suff,pdTheta,params);
-    transformTheta(pdTheta,t_pdTheta,param_len,&setP);
+      ecoEMStep(params,Suff,pdTheta);
+    transformTheta(pdTheta,t_pdTheta,param_len,setP);
+    //once theta looks converged, the next iteration runs at full precision and decides
+    lastTol=setP->intTol;
+    if (setP->sem==0)
+      setP->intTol=closeEnough(t_pdTheta,t_pdTheta_old,param_len,*convergence) ? INT_Tol :
+        ecoIntTol(t_pdTheta,t_pdTheta_old,param_len);
     //char ch;
     //scanf(" %c", &ch );
 
     //if we're in the second run through of SEM
-    if (setP.sem==1) {
+    if (setP->sem==1) {
       ecoSEM(optTheta, pdTheta, params, Rmat_old, Rmat);
     }
     else {
-      setHistory(t_pdTheta,(main_loop<=1) ? 0 : Suff[setP.suffstat_len],main_loop,(setParam*)&setP,history_full);
+      setHistory(t_pdTheta,(main_loop<=1) ? 0 : Suff[setP->suffstat_len],main_loop,setP,history);
     }
 
 
-    if (setP.verbose>=2) {
+    if (setP->verbose>=2) {
       Rprintf("theta and suff\n");
       if (param_len>5) {
         Rprintf("%10g%10g%10g%10g%10g%10g%10g%10g%10g\n",pdTheta[0],pdTheta[1],pdTheta[2],pdTheta[3],pdTheta[4],pdTheta[5],pdTheta[6],pdTheta[7],pdTheta[8]);
@@ -231,21 +373,27 @@ void cEMeco(
         Rprintf("%10g%10g%10g%10g%10g (%10g)\n",pdTheta[0],pdTheta[1],pdTheta[2],pdTheta[3],pdTheta[4],pdTheta[4]*sqrt(pdTheta[2]*pdTheta[3]));
       }
       Rprintf("%10g%10g%10g%10g%10g\n",Suff[0],Suff[1],Suff[2],Suff[3],Suff[4]);
-      Rprintf("Sig: %10g%10g%10g\n",setP.Sigma[0][0],setP.Sigma[1][1],setP.Sigma[0][1]);
-      if (setP.ncar) Rprintf("Sig3: %10g%10g%10g%10g\n",setP.Sigma3[0][0],setP.Sigma3[1][1],setP.Sigma3[2][2]);
+      Rprintf("Sig: %10g%10g%10g\n",setP->Sigma[0][0],setP->Sigma[1][1],setP->Sigma[0][1]);
+      if (setP->ncar) Rprintf("Sig3: %10g%10g%10g%10g\n",setP->Sigma3[0][0],setP->Sigma3[1][1],setP->Sigma3[2][2]);
       //char x;
       //R_ReadConsole("hit enter\n",(char*)&x,4,0);
     }
     main_loop++;
-    R_FlushConsole();
-    R_CheckUserInterrupt();
+    if (!quiet) {
+      R_FlushConsole();
+      R_CheckUserInterrupt();
+    }
   }
 
   /***End main loop ***/
+  if (setP->invErr) status=FIT_SingularSigma;
   //finish up: record results and loglik
   Param* param;
-  Suff[setP.suffstat_len]=0.0;
-  for(i=0;i<param_len;i++) setP.pdTheta[i]=pdTheta[i];
+  setP->intTol=INT_Tol; //in case the loop stopped at iteration_max
+  //L-BFGS ends with an E-step at the final theta, whose log-likelihood has relative precision INT_Tol
+  if (!useLBFGS) Suff[setP->suffstat_len]=0.0;
+  for(i=0;i<param_len;i++) setP->pdTheta[i]=pdTheta[i];
+  setDensityConst(setP);
   for(i=0;i<t_samp;i++) {
      param=&(params[i]);
     if(i<n_samp) {
@@ -253,48 +401,142 @@ void cEMeco(
       //setBounds(param);
       //setNormConst(param);
     }
-    Suff[setP.suffstat_len]+=getLogLikelihood(param);
+    if (!useLBFGS) Suff[setP->suffstat_len]+=param->caseP.weight*getLogLikelihood(param);
+    if (!quiet) printIntegrationError(param);
   }
+  //observed information = complete information (computed by the caller) - missing information
+  if (*louis && !setP->sem) ecoMissingInfo(params,Imiss);
 
-  if (setP.verbose>=1) {
-    printColumnHeader(main_loop,*iteration_max,&setP,1);
+  if (setP->verbose>=1) {
+    printColumnHeader(main_loop,*iteration_max,setP,1);
     Rprintf("Final Theta:");
       for(i=0;i<param_len;i++) {
         if (pdTheta[i]>=0) Rprintf("% 5.3f",pdTheta[i]);
         else Rprintf(" % 5.2f",pdTheta[i]);
       }
-      if (setP.calcLoglik==1 && main_loop>2) {
-        Rprintf(" Final LL: %5.2f",Suff[setP.suffstat_len]);
-        history_full[main_loop-1][param_len]=Suff[setP.suffstat_len];
-      }
+      if (setP->calcLoglik==1 && main_loop>2)
+        Rprintf(" Final LL: %5.2f",Suff[setP->suffstat_len]);
       Rprintf("\n");
     }
 
+  //the last iteration is always recorded, with the final log-likelihood
+  if (setP->sem==0) {
+    if ((main_loop-1)%setP->historyEvery!=0) {
+      for(j=0;j<param_len;j++) history[setP->historyRows*(param_len+1)+j]=t_pdTheta[j];
+      setP->historyRows++;
+    }
+    if (setP->calcLoglik==1 && main_loop>2)
+      history[(setP->historyRows-1)*(param_len+1)+param_len]=Suff[setP->suffstat_len];
+  }
+
   //set the DM matrix (only matters for SEM)
-  if (setP.sem==1) {
+  if (setP->sem==1) {
     int DMlen=0;
     for(i=0; i<param_len;i++)
-      if(setP.varParam[i]) DMlen++;
+      if(setP->varParam[i]) DMlen++;
     for(i=0;i<DMlen;i++)
       for(j=0;j<DMlen;j++)
         DMmatrix[i*DMlen+j]=Rmat[i][j];
   }
 
   *itersUsed=main_loop;
-  for(i=0;i<(*itersUsed);i++) {
-    for(j=0;j<(param_len+1);j++)
-      history[i*(param_len+1)+j]=history_full[i][j];
-  }
-
-
-  /* write out the random seed */
-  PutRNGstate();
+  *historyRows=setP->historyRows;
 
   /* Freeing the memory */
   Free(pdTheta_old);
+  Free(t_pdTheta);
+  Free(t_pdTheta_old);
+  Free(setP->pdTheta);
+  FreeMatrix(setP->SigmaK,param_len);
+  FreeMatrix(setP->InvSigmaK,param_len);
+  if (setP->hypTest==1) FreeMatrix(setP->hypTestCoeff,setP->ncar ? 3 : 2);
+  freeAreaLines(&(setP->lines));
+  Free(params);
   //FreeMatrix(Rmat_old,5);
   //FreeMatrix(Rmat,5);
+  return status;
+}
+
+/**
+ * Fits the model by EM to each of several independent groups of areas in one call,
+ * e.g. one per state or contest, with the same options and starting values.
+ * The groups are fitted concurrently, one thread per group taken in turn as threads
+ * free up, each quietly (see ecoEMFit) with its own setParam and a single-threaded
+ * E-step; batchSize=0 keeps R's RNG out of the fits. The first failed group is
+ * reported by error() once all groups are done.
+ * Inputs and outputs are those of cEMeco stacked by group: the general areas
+ * (0<X<1) of group g are pdX[2*a..2*(a+n)) (X then Y) for a=groupN[0]+...+groupN[g-1],
+ * and likewise for the bounds, the X=1 and X=0 areas and inSample.
+ * pdTheta and Suff hold 9 (NCAR) or 5 (CAR) values per group, Suff then the loglik.
+ */
+void cEMecoBatch(double *pdX, int *nGroups, int *groupN, double *minW1, double *maxW1,
+                 int *groupX1, double *x1_W1, int *groupX0, double *x0_W2,
+                 double *pdTheta_in, int *iteration_max, double *convergence,
+                 int *flag, int *verbosiosity, int *quadType, int *quadOrder, int *nThreads,
+                 int *accelerate, int *optimizer,
+                 double *pdTheta, double *Suff, double *inSample, int *itersUsed) {
+  int g, i, j, nMax=0;
+  int n_var=bit(*flag,0) ? 9 : 5;
+  int emFlag=*flag & 3; //no SEM
+  int survey=0, sur_samp=0, calcLoglik=1, hypTest=0, louis=0, batchSize=0, batchPasses=0, one=1;
+  int historyEvery=*iteration_max+1; //only the starting values and the last iteration
+  double sur_W=0;
+  quadRule quad;
+
+  int *a=intArray(*nGroups), *a1=intArray(*nGroups), *a0=intArray(*nGroups);
+  for(g=0;g<*nGroups;g++) {
+    nMax=imax2(nMax,groupN[g]);
+    a[g]=(g==0) ? 0 : a[g-1]+groupN[g-1];
+    a1[g]=(g==0) ? 0 : a1[g-1]+groupX1[g-1];
+    a0[g]=(g==0) ? 0 : a0[g-1]+groupX0[g-1];
+  }
+  double *pdWeight=doubleArray(nMax);
+  for(i=0;i<nMax;i++) pdWeight[i]=1;
+  setParam* setP=(setParam*) Calloc(*nGroups,setParam);
+  int *status=intArray(*nGroups);
+  initQuadRule(&quad,*quadType,*quadOrder);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(dynamic) num_threads(*nThreads>0 ? *nThreads : omp_get_max_threads())
+#endif
+  for(g=0;g<*nGroups;g++) {
+    int x1=(groupX1[g]>0), x0=(groupX0[g]>0), historyRows;
+    double optTheta[9], DMmatrix[81], Imiss[81], history[3*10];
+    for(i=0;i<9;i++) optTheta[i]=-1.1;
+    setP[g].quad=quad;
+    status[g]=ecoEMFit(setP+g,1,pdX+2*a[g],pdTheta_in,groupN+g,pdWeight,iteration_max,convergence,
+                       &survey,&sur_samp,&sur_W,&x1,groupX1+g,x1_W1+a1[g],&x0,groupX0+g,x0_W2+a0[g],
+                       minW1+a[g],maxW1+a[g],&emFlag,verbosiosity,&calcLoglik,&hypTest,quadType,quadOrder,&one,
+                       accelerate,&louis,&historyEvery,optimizer,&batchSize,&batchPasses,optTheta,
+                       pdTheta+g*n_var,Suff+g*(n_var+1),inSample+2*a[g],DMmatrix,itersUsed+g,
+                       history,&historyRows,Imiss);
+  }
+  freeQuadRule(&quad);
+
+  int failed=-1, failStatus=FIT_OK, invErr=0, invErrStep=0;
+  char* invErrMsg=NULL;
+  for(g=0;g<*nGroups && failed<0;g++) {
+    if (status[g]!=FIT_OK) {
+      failed=g; failStatus=status[g];
+      invErr=setP[g].invErr; invErrStep=setP[g].invErrStep; invErrMsg=setP[g].invErrMsg;
+    }
+    else if (*verbosiosity>=1) {
+      Rprintf("Group %d of %d: %d areas, %d iterations; Final Theta:",g+1,*nGroups,
+              groupN[g]+groupX1[g]+groupX0[g],itersUsed[g]);
+      for(j=0;j<n_var;j++) Rprintf(" % 5.3f",pdTheta[g*n_var+j]);
+      Rprintf(" Final LL: %5.2f\n",Suff[g*(n_var+1)+n_var]);
+    }
   }
+  free(a); free(a1); free(a0); free(status);
+  Free(setP);
+  Free(pdWeight);
+
+  if (failed>=0) {
+    Rprintf("Group %d of %d: ",failed+1,*nGroups);
+    if (failStatus==FIT_SingularSigma) dinv2DFail(invErr,invErrStep,invErrMsg);
+    error("L-BFGS: invalid starting values");
+  }
+}
 
 /**
  * initializes Theta, varParam, and semDone
@@ -320,11 +562,11 @@ void initTheta(double* pdTheta_in,Param* params, double* pdTheta) {
     pdTheta[0]=0; mu3sq=0;
     for(i=0;i<setP->t_samp;i++) {
       lx=logit(params[i].caseP.X,"initpdTheta0");
-      pdTheta[0] += lx;
-      mu3sq += lx*lx;
+      pdTheta[0] += params[i].caseP.weight*lx;
+      mu3sq += params[i].caseP.weight*lx*lx;
     }
-    pdTheta[0] = pdTheta[0]/setP->t_samp;
-    mu3sq = mu3sq/setP->t_samp;
+    pdTheta[0] = pdTheta[0]/setP->t_weight;
+    mu3sq = mu3sq/setP->t_weight;
     pdTheta[3] = mu3sq-pdTheta[0]*pdTheta[0]; //variance
     //fill from pdTheta_in
     pdTheta[1]=pdTheta_in[0];
@@ -358,7 +600,8 @@ void ecoEStep(Param* params, double* suff) {
 
   int t_samp,n_samp,s_samp,x1_samp,x0_samp,i,j, verbose;
   // double loglik,testdens;
-  double loglik;
+  double loglik,temp0,temp1;
+  double moments[MOM_Len];
   Param* param; setParam* setP; caseParam* caseP;
   setP=params[0].setP;
   verbose=setP->verbose;
@@ -370,12 +613,22 @@ void ecoEStep(Param* params, double* suff) {
   s_samp=setP->s_samp;
 
   double **Wstar=doubleMatrix(t_samp,5);     /* pseudo data(transformed)*/
+  double *loglik_i=doubleArray(n_samp);      /* loglik contribution of each area */
   loglik=0;
+  //density constants for the current Sigma, shared by all the integrands below
+  setDensityConst(setP);
   if (verbose>=3 && !setP->sem) Rprintf("E-step start\n");
+  /* areas are independent given theta: each thread fills its own rows of Wstar and loglik_i,
+   * which are summed below in area order, so the result does not depend on the number of threads.
+   * Nothing is printed from inside the parallel loop */
+#ifdef _OPENMP
+#pragma omp parallel for private(param,caseP,moments,j) schedule(dynamic,8) num_threads(setP->threads>0 ? setP->threads : omp_get_max_threads())
+#endif
   for (i = 0; i<n_samp; i++) {
     param = &(params[i]);
     caseP=&(param->caseP);
-    if (caseP->Y>=.990 || caseP->Y<=.010) { //if Y is near the edge, then W1 and W2 are very constrained
+    loglik_i[i]=0;
+    if (setP->lines.degenerate[caseP->id]) { //if Y is near the edge, then W1 and W2 are very constrained
       Wstar[i][0]=logit(caseP->Y,"Y maxmin W1");
       Wstar[i][1]=logit(caseP->Y,"Y maxmin W2");
       Wstar[i][2]=Wstar[i][0]*Wstar[i][0];
@@ -385,46 +638,46 @@ void ecoEStep(Param* params, double* suff) {
       caseP->Wstar[1]=Wstar[i][1];
       caseP->W[0]=caseP->Y;
       caseP->W[1]=caseP->Y;
-      if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(param);
+      if (setP->calcLoglik==1 && setP->iter>1) loglik_i[i]=getLogLikelihood(param);
       //Rprintf("Skipping %d, Y=%5g",i,caseP->Y);
     }
     else {
-      setBounds(param); //I think you only have to do this once...check later
-      /*if (verbose>=2 && setP->iter==12 && i==422) {
-        Rprintf("Bounds: %5g %5g %5g %5g\n",caseP->Wbounds[0][0],caseP->Wbounds[0][1],caseP->Wbounds[1][0],caseP->Wbounds[1][1]);
-        setP->weirdness=1;
-      }
-      else setP->weirdness=0;*/
-
-      setNormConst(param);
+      //normalizing constant and all moments in one pass over the tomography line
+      setMoments(param,moments);
       for (j=0;j<5;j++) {
-        caseP->suff=j;
-        Wstar[i][j]=paramIntegration(&SuffExp,param);
+        Wstar[i][j]=moments[MOM_W1star+j];
         if (j<2)
           caseP->Wstar[j]=Wstar[i][j];
       }
-      caseP->suff=SS_W1;
-      caseP->W[0]=paramIntegration(&SuffExp,param);
-      caseP->suff=SS_W2;
-      caseP->W[1]=paramIntegration(&SuffExp,param);
+      caseP->W[0]=moments[MOM_W1];
+      caseP->W[1]=moments[MOM_W2];
       caseP->suff=SS_Test;
-      // testdens=paramIntegration(&SuffExp,param);
-      if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(param);
-
-      //report error E1 if E[W1],E[W2] is not on the tomography line
-      if (fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1]))>0.011) {
-        Rprintf("E1 %d %5g %5g %5g %5g %5g %5g %5g %5g err:%5g\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], caseP->normcT,Wstar[i][0],Wstar[i][1],Wstar[i][2],fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1])));
-        // char ch;
-        // scanf("Hit enter to continue %c\n", &ch );
-      }
-      //report error E2 if Jensen's inequality doesn't hold
-      if (Wstar[i][4]<pow(Wstar[i][1],2) || Wstar[i][2]<pow(Wstar[i][0],2))
-        Rprintf("E2 %d %5g %5g %5g %5g %5g %5g %5g %5g\n", i, caseP->X, caseP->Y, caseP->normcT, caseP->mu[1],Wstar[i][0],Wstar[i][1],Wstar[i][2],Wstar[i][4]);
-      //used for debugging if necessary
-      if (verbose>=2 && !setP->sem && ((i<10 && verbose>=3) || (caseP->mu[1] < -1.7 && caseP->mu[0] > 1.4)))
-        Rprintf("%d %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], param->setP->Sigma[0][1], caseP->normcT, caseP->W[0],caseP->W[1],Wstar[i][2]);
+      if (setP->calcLoglik==1 && setP->iter>1) loglik_i[i]=normCLogLikelihood(param);
+    }
+  }
+
+  /* sum the loglik and print the per-area diagnostics in area order */
+  for (i = 0; i<n_samp; i++) {
+    param = &(params[i]);
+    caseP=&(param->caseP);
+    loglik+=caseP->weight*loglik_i[i];
+    if (setP->quiet) continue;
+    printIntegrationError(param);
+    if (setP->lines.degenerate[caseP->id]) continue;
+    //report error E1 if E[W1],E[W2] is not on the tomography line
+    if (fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1]))>0.011) {
+      Rprintf("E1 %d %5g %5g %5g %5g %5g %5g %5g %5g err:%5g\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], caseP->normcT,Wstar[i][0],Wstar[i][1],Wstar[i][2],fabs(caseP->W[0]-getW1FromW2(caseP->X, caseP->Y,caseP->W[1])));
+      // char ch;
+      // scanf("Hit enter to continue %c\n", &ch );
     }
+    //report error E2 if Jensen's inequality doesn't hold
+    if (Wstar[i][4]<pow(Wstar[i][1],2) || Wstar[i][2]<pow(Wstar[i][0],2))
+      Rprintf("E2 %d %5g %5g %5g %5g %5g %5g %5g %5g\n", i, caseP->X, caseP->Y, caseP->normcT, caseP->mu[1],Wstar[i][0],Wstar[i][1],Wstar[i][2],Wstar[i][4]);
+    //used for debugging if necessary
+    if (verbose>=2 && !setP->sem && ((i<10 && verbose>=3) || (caseP->mu[1] < -1.7 && caseP->mu[0] > 1.4)))
+      Rprintf("%d %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f\n", i, caseP->X, caseP->Y, caseP->mu[0], caseP->mu[1], param->setP->Sigma[0][1], caseP->normcT, caseP->W[0],caseP->W[1],Wstar[i][2]);
   }
+  Free(loglik_i);
 
 
   /* Use the values given by the survey data */
@@ -442,24 +695,30 @@ void ecoEStep(Param* params, double* suff) {
 
   /* analytically compute E{W2_i|Y_i} given W1_i, mu and Sigma in x1 homeogeneous areas */
   for (i=n_samp+s_samp; i<n_samp+s_samp+x1_samp; i++) {
-    /*temp0=params[i].caseP.Wstar[0];
-    temp1=params[i].caseP.mu[1]+setP->Sigma[0][1]/setP->Sigma[0][0]*(temp0-params[i].caseP.mu[0]);
+    caseP=&(params[i].caseP);
+    temp0=caseP->Wstar[0];
+    temp1=caseP->mu[1]+setP->Sigma[0][1]/setP->Sigma[0][0]*(temp0-caseP->mu[0]);
+    caseP->Wstar[1]=temp1;
     Wstar[i][0]=temp0;
     Wstar[i][1]=temp1;
     Wstar[i][2]=temp0*temp0;
     Wstar[i][3]=temp0*temp1;
-    Wstar[i][4]=temp1*temp1;*/
+    Wstar[i][4]=temp1*temp1+setP->Sigma[1][1]-setP->Sigma[0][1]*setP->Sigma[0][1]/setP->Sigma[0][0];
+    if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(&params[i]);
   }
 
   /*analytically compute E{W1_i|Y_i} given W2_i, mu and Sigma in x0 homeogeneous areas */
   for (i=n_samp+s_samp+x1_samp; i<n_samp+s_samp+x1_samp+x0_samp; i++) {
-    /*temp1=params[i].caseP.Wstar[1];
-    temp0=params[i].caseP.mu[0]+setP->Sigma[0][1]/setP->Sigma[1][1]*(temp1-params[i].caseP.mu[1]);
+    caseP=&(params[i].caseP);
+    temp1=caseP->Wstar[1];
+    temp0=caseP->mu[0]+setP->Sigma[0][1]/setP->Sigma[1][1]*(temp1-caseP->mu[1]);
+    caseP->Wstar[0]=temp0;
     Wstar[i][0]=temp0;
     Wstar[i][1]=temp1;
-    Wstar[i][2]=temp0*temp0;
+    Wstar[i][2]=temp0*temp0+setP->Sigma[0][0]-setP->Sigma[0][1]*setP->Sigma[0][1]/setP->Sigma[1][1];
     Wstar[i][3]=temp0*temp1;
-    Wstar[i][4]=temp1*temp1;*/
+    Wstar[i][4]=temp1*temp1;
+    if (setP->calcLoglik==1 && setP->iter>1) loglik+=getLogLikelihood(&params[i]);
   }
 
 
@@ -471,30 +730,32 @@ void ecoEStep(Param* params, double* suff) {
   //CAR: (0) E[W1*] (1) E[W2*] (2) E[W1*^2] (3) E[W2*^2] (4) E[W1*W2*] (5) loglik
   //NCAR: (0) X, (1) W1, (2) W2, (3) X^2, (4) W1^2, (5) W2^2, (6) x*W1, (7) X*W2, (8) W1*W2, (9) loglik
   /* compute sufficient statistics */
+  /* each record counts for the identical areas it stands for */
   for (i=0; i<t_samp; i++) {
+    double w=params[i].caseP.weight;
     if (!setP->ncar) {
-      suff[0] += Wstar[i][0];  /* sumE(W_i1|Y_i) */
-      suff[1] += Wstar[i][1];  /* sumE(W_i2|Y_i) */
-      suff[2] += Wstar[i][2];  /* sumE(W_i1^2|Y_i) */
-      suff[3] += Wstar[i][4];  /* sumE(W_i2^2|Y_i) */
-      suff[4] += Wstar[i][3];  /* sumE(W_i1*W_i2|Y_i) */
+      suff[0] += w*Wstar[i][0];  /* sumE(W_i1|Y_i) */
+      suff[1] += w*Wstar[i][1];  /* sumE(W_i2|Y_i) */
+      suff[2] += w*Wstar[i][2];  /* sumE(W_i1^2|Y_i) */
+      suff[3] += w*Wstar[i][4];  /* sumE(W_i2^2|Y_i) */
+      suff[4] += w*Wstar[i][3];  /* sumE(W_i1*W_i2|Y_i) */
     }
     else if (setP->ncar) {
       double lx= logit(params[i].caseP.X,"mstep X");
-      suff[0] += lx;
-      suff[1] += Wstar[i][0];
-      suff[2] += Wstar[i][1];
-      suff[3] += lx*lx;
-      suff[4] += Wstar[i][2];
-      suff[5] += Wstar[i][4];
-      suff[6] += params[i].caseP.Wstar[0]*lx;
-      suff[7] += params[i].caseP.Wstar[1]*lx;
-      suff[8] += Wstar[i][3];
+      suff[0] += w*lx;
+      suff[1] += w*Wstar[i][0];
+      suff[2] += w*Wstar[i][1];
+      suff[3] += w*lx*lx;
+      suff[4] += w*Wstar[i][2];
+      suff[5] += w*Wstar[i][4];
+      suff[6] += w*params[i].caseP.Wstar[0]*lx;
+      suff[7] += w*params[i].caseP.Wstar[1]*lx;
+      suff[8] += w*Wstar[i][3];
     }
   }
 
   for(j=0; j<setP->suffstat_len; j++)
-    suff[j]=suff[j]/t_samp;
+    suff[j]=suff[j]/setP->t_weight;
   //Rprintf("%5g suff0,2,4 %5g %5g %5g\n",setP->pdTheta[6],suff[0],suff[2],suff[4]);
   //if(verbose>=1) Rprintf("Log liklihood %15g\n",loglik);
   suff[setP->suffstat_len]=loglik;
@@ -502,6 +763,379 @@ void ecoEStep(Param* params, double* suff) {
   FreeMatrix(Wstar,t_samp);
 }
 
+/**
+ * Missing information by Louis' method at the current theta: the sum over the areas of
+ * the conditional covariance of the complete-data score given Y (see InfoExpAll and
+ * InfoHomog). Survey and degenerate areas, whose W is known, add nothing. Called after the final
+ * E-step, once setDensityConst has been called for the current Sigma
+ * mutates: Imiss (p x p by rows, p=infoParamLen), on the scale of transformTheta
+ **/
+void ecoMissingInfo(Param* params, double* Imiss) {
+  setParam* setP=params[0].setP;
+  int n_samp=setP->n_samp;
+  int p=infoParamLen(setP), nf=1+p+p*(p+1)/2;
+  int i,j,k,l;
+  double *Ef=doubleArray(p);
+  double *integrals=doubleArray(n_samp*nf); //the integrals of InfoExpAll, by area
+  double *homog=doubleArray(nf);
+
+  for (j=0;j<p*p;j++) Imiss[j]=0;
+  /* as in ecoEStep: each thread fills its own areas, summed below in area order */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,8) num_threads(setP->threads>0 ? setP->threads : omp_get_max_threads())
+#endif
+  for (i=0;i<n_samp;i++)
+    if (!setP->lines.degenerate[i])
+      vecParamIntegration(&InfoExpAll,(void*)&params[i],nf,integrals+i*nf);
+
+  //homogeneous areas, in closed form (see InfoHomog), after the general ones
+  for (i=0;i<setP->t_samp;i++) {
+    double* area;
+    if (i<n_samp) {
+      if (setP->lines.degenerate[i]) continue;
+      printIntegrationError(&params[i]);
+      area=integrals+i*nf;
+    }
+    else if (params[i].caseP.dataType==DPT_Homog_X1 || params[i].caseP.dataType==DPT_Homog_X0) {
+      InfoHomog(&params[i],homog,nf);
+      area=homog;
+    }
+    else continue;
+    for (j=0;j<p;j++) Ef[j]=area[1+j]/area[0];
+    l=1+p;
+    for (j=0;j<p;j++)
+      for (k=j;k<p;k++) {
+        Imiss[j*p+k]+=params[i].caseP.weight*(area[l++]/area[0]-Ef[j]*Ef[k]);
+        if (k>j) Imiss[k*p+j]=Imiss[j*p+k];
+      }
+  }
+  Free(Ef); Free(integrals); Free(homog);
+}
+
+/**
+ * One EM iteration: the E-step at the current params, followed by the M-step
+ * input: params (set from pdTheta)
+ * mutated (i.e., output): Suff, pdTheta, params
+ */
+void ecoEMStep(Param* params, double* Suff, double* pdTheta) {
+  int i;
+  setParam* setP=params[0].setP;
+  for(i=0;i<setP->param_len;i++) setP->pdTheta[i]=pdTheta[i]; //read by getLogLikelihood
+  ecoEStep(params, Suff);
+  if (!setP->ncar)
+    ecoMStep(Suff,pdTheta,params);
+  else
+    ecoMStepNCAR(Suff,pdTheta,params);
+}
+
+/**
+ * One SQUAREM cycle (Varadhan and Roland 2008, scheme S3) in place of an EM iteration
+ * Two EM steps from theta0 give theta1 and theta2; with r=theta1-theta0 and
+ * v=theta2-2*theta1+theta0 (in the coordinates of thetaToAccel), the cycle extrapolates to
+ * theta0+2*s*r+s^2*v with step length s=|r|/|v|, kept within [1,stepMax], and
+ * stabilizes the result with one more EM step.
+ * The extrapolation is only kept if it is a proper theta whose log-likelihood is
+ * no smaller than that of theta0, which keeps the cycle monotone like EM; otherwise
+ * the cycle falls back to theta2.
+ * stepMax starts at 1; it grows by a factor of 4 each time the step length reaches it and
+ * is kept, and shrinks by the same factor when such a step is rejected.
+ * input: params (set from pdTheta), stepMax
+ * mutated (i.e., output): Suff, pdTheta, params, stepMax
+ * On exit Suff[suffstat_len] is the log-likelihood of the input theta, as after ecoEMStep
+ */
+void ecoSQUAREM(Param* params, double* Suff, double* pdTheta, double* stepMax) {
+  setParam* setP=params[0].setP;
+  int len=setP->param_len;
+  int j, accepted=0;
+  double theta1[len], theta2[len], thetaE[len];
+  double a0[len], a1[len], a2[len], aE[len]; //theta0, theta1, theta2 and the extrapolation in SQUAREM coordinates
+  double r, v, rr=0, vv=0, step, loglik0;
+
+  for(j=0;j<len;j++) theta1[j]=pdTheta[j];
+  ecoEMStep(params,Suff,theta1);
+  loglik0=Suff[setP->suffstat_len];
+  for(j=0;j<len;j++) theta2[j]=theta1[j];
+  ecoEMStep(params,Suff,theta2);
+
+  thetaToAccel(pdTheta,a0,setP);
+  thetaToAccel(theta1,a1,setP);
+  thetaToAccel(theta2,a2,setP);
+  for(j=0;j<len;j++) {
+    r=a1[j]-a0[j];
+    v=a2[j]-2*a1[j]+a0[j];
+    rr+=r*r; vv+=v*v;
+  }
+  step=(vv>0) ? sqrt(rr/vv) : 1;
+  if (!R_FINITE(step) || step<1) step=1;
+  if (step>*stepMax) step=*stepMax;
+
+  if (step>1) {
+    for(j=0;j<len;j++)
+      aE[j]=a0[j]+2*step*(a1[j]-a0[j])+step*step*(a2[j]-2*a1[j]+a0[j]);
+    accelToTheta(aE,thetaE,setP);
+    for(j=0;j<len;j++)
+      if (!setP->varParam[j]) thetaE[j]=pdTheta[j]; //constants stay exact
+    if (validTheta(thetaE,setP)) {
+      setParamsFromTheta(params,thetaE);
+      ecoEMStep(params,Suff,thetaE);
+      if (R_FINITE(Suff[setP->suffstat_len]) && Suff[setP->suffstat_len]>=loglik0 && validTheta(thetaE,setP))
+        accepted=1;
+    }
+    if (setP->verbose>=2)
+      Rprintf("SQUAREM step length %5g %s\n",step,accepted ? "accepted" : "rejected");
+    if (!accepted) setParamsFromTheta(params,theta2);
+  }
+  //a step of length 1 gives theta2 itself, which is always kept
+  if (step==*stepMax) {
+    if (accepted || step==1) *stepMax*=4;
+    else *stepMax=fmax2(1,*stepMax/4);
+  }
+
+  for(j=0;j<len;j++) pdTheta[j]=accepted ? thetaE[j] : theta2[j];
+  Suff[setP->suffstat_len]=loglik0;
+}
+
+/* number of (s,y) pairs kept by ecoLBFGS */
+static const int lbfgsMemory=6;
+/* Armijo constant and most step halvings of the ecoLBFGS line search */
+static const double lbfgsArmijo=1e-4;
+static const int lbfgsHalvings=30;
+
+/**
+ * Negative log-likelihood at the transformed theta t0, with its free parameters idx set to x,
+ * by one E-step, and its gradient with respect to x (see scoreSuff)
+ * returns: R_PosInf if this is not a proper theta
+ * mutates: pdTheta (constants are kept from theta0), grad, Suff, params
+ */
+static double lbfgsEval(Param* params, double* Suff, double* x, double* t0, double* theta0,
+                        int* idx, int nfree, double* pdTheta, double* grad) {
+  setParam* setP=params[0].setP;
+  int j, len=setP->param_len;
+  double t[len], score[9];
+  for(j=0;j<len;j++) t[j]=t0[j];
+  for(j=0;j<nfree;j++) t[idx[j]]=x[j];
+  untransformTheta(t,pdTheta,len,setP);
+  for(j=0;j<len;j++)
+    if (!setP->varParam[j]) pdTheta[j]=theta0[j];
+  if (!validTheta(pdTheta,setP)) return R_PosInf;
+  setParamsFromTheta(params,pdTheta);
+  for(j=0;j<len;j++) setP->pdTheta[j]=pdTheta[j];
+  ecoEStep(params,Suff);
+  scoreSuff(setP,Suff,score);
+  for(j=0;j<nfree;j++) grad[j]=-score[idx[j]];
+  return -Suff[setP->suffstat_len];
+}
+
+/**
+ * Maximizes the log-likelihood directly by L-BFGS (Nocedal and Wright 2006, Algorithm 7.5)
+ * over the free parameters on the scale of transformTheta, in place of the EM iterations.
+ * Each evaluation is one E-step at full precision, which gives the log-likelihood
+ * (see normCLogLikelihood) and its gradient (see scoreSuff). Steps are halved until they
+ * satisfy the Armijo condition; pairs with no positive curvature are not kept.
+ * Stops once a full step moves no transformed parameter by convergence or more, as EM does,
+ * or when no step along the search direction increases the log-likelihood.
+ * Not for NCAR with fixed rho, whose constraint is not on this scale, nor for hypothesis tests.
+ * input: pdTheta (params set from it)
+ * mutates: pdTheta, t_pdTheta, Suff, params (E-step at the final theta), history
+ * returns: number of iterations, or -1 if the log-likelihood at the start is not finite (quiet fits)
+ */
+int ecoLBFGS(Param* params, double* Suff, double* pdTheta, double* t_pdTheta, int iteration_max, double* history) {
+  setParam* setP=params[0].setP;
+  int len=setP->param_len, m=lbfgsMemory;
+  int i, j, k, iter, nfree=0, stored=0, newest=0, halvings, converged=0;
+  int idx[9];
+  double theta0[len], thetaNew[len], t0[len];
+  double x[len], g[len], d[len], xNew[len], gNew[len], alpha[m], rho[m], S[m][len], Y[m][len];
+  double f, fNew, gd, step, sy, yy, ss, beta, gamma;
+
+  for(j=0;j<len;j++) theta0[j]=pdTheta[j];
+  transformTheta(pdTheta,t0,len,setP);
+  for(j=0;j<infoParamLen(setP);j++)
+    if (setP->varParam[j]) idx[nfree++]=j;
+  for(j=0;j<nfree;j++) x[j]=t0[idx[j]];
+  setP->iter=2; //so that the E-step computes the log-likelihood
+  f=lbfgsEval(params,Suff,x,t0,theta0,idx,nfree,thetaNew,g);
+  if (!R_FINITE(f)) {
+    if (!setP->quiet) error("L-BFGS: invalid starting values");
+    return -1;
+  }
+
+  for (iter=1; iter<=iteration_max && !converged && !setP->invErr; iter++) {
+    if (setP->verbose>=1) {
+      if ((iter - 1) % 15 == 0) printColumnHeader(iter,iteration_max,setP,0);
+      Rprintf("cycle %d/%d:",iter,iteration_max);
+      for(i=0;i<len;i++)
+        if (setP->varParam[i]) {
+          if (pdTheta[i]>=0) Rprintf("% 5.3f",pdTheta[i]);
+          else Rprintf(" % 5.2f",pdTheta[i]);
+        }
+      Rprintf(" LL: %5.2f\n",-f);
+    }
+
+    //search direction d=-Hg by the two-loop recursion, scaled by the newest pair
+    for(j=0;j<nfree;j++) d[j]=-g[j];
+    for(k=0;k<stored;k++) {
+      i=(newest-k+m)%m;
+      alpha[i]=0;
+      for(j=0;j<nfree;j++) alpha[i]+=rho[i]*S[i][j]*d[j];
+      for(j=0;j<nfree;j++) d[j]-=alpha[i]*Y[i][j];
+    }
+    if (stored>0) {
+      sy=0; yy=0;
+      for(j=0;j<nfree;j++) { sy+=S[newest][j]*Y[newest][j]; yy+=Y[newest][j]*Y[newest][j]; }
+      gamma=sy/yy;
+    }
+    else {
+      //no curvature yet: a first step of length one in the transformed parameters
+      gamma=0;
+      for(j=0;j<nfree;j++) gamma+=g[j]*g[j];
+      gamma=1/sqrt(gamma);
+    }
+    for(j=0;j<nfree;j++) d[j]*=gamma;
+    for(k=stored-1;k>=0;k--) {
+      i=(newest-k+m)%m;
+      beta=0;
+      for(j=0;j<nfree;j++) beta+=rho[i]*Y[i][j]*d[j];
+      for(j=0;j<nfree;j++) d[j]+=(alpha[i]-beta)*S[i][j];
+    }
+    gd=0;
+    for(j=0;j<nfree;j++) gd+=g[j]*d[j];
+    if (!(gd<0)) break; //the gradient vanishes to the precision of the E-step
+
+    //backtracking line search
+    step=1;
+    for(halvings=0;halvings<lbfgsHalvings;halvings++) {
+      for(j=0;j<nfree;j++) xNew[j]=x[j]+step*d[j];
+      fNew=lbfgsEval(params,Suff,xNew,t0,theta0,idx,nfree,thetaNew,gNew);
+      if (R_FINITE(fNew) && fNew<=f+lbfgsArmijo*step*gd) break;
+      step/=2;
+    }
+    if (halvings==lbfgsHalvings) {
+      //no increase along d: leave the E-step at the last theta
+      lbfgsEval(params,Suff,x,t0,theta0,idx,nfree,thetaNew,g);
+      break;
+    }
+    if (setP->verbose>=2) Rprintf("L-BFGS step length %5g\n",step);
+
+    sy=0; yy=0; ss=0; converged=(halvings==0);
+    for(j=0;j<nfree;j++) {
+      sy+=(xNew[j]-x[j])*(gNew[j]-g[j]);
+      yy+=(gNew[j]-g[j])*(gNew[j]-g[j]);
+      ss+=(xNew[j]-x[j])*(xNew[j]-x[j]);
+      if (fabs(xNew[j]-x[j])>=setP->convergence) converged=0;
+    }
+    if (sy>1e-10*sqrt(ss*yy)) {
+      newest=(newest+1)%m;
+      for(j=0;j<nfree;j++) {
+        S[newest][j]=xNew[j]-x[j];
+        Y[newest][j]=gNew[j]-g[j];
+      }
+      rho[newest]=1/sy;
+      if (stored<m) stored++;
+    }
+
+    for(j=0;j<nfree;j++) { x[j]=xNew[j]; g[j]=gNew[j]; }
+    for(j=0;j<len;j++) pdTheta[j]=thetaNew[j];
+    transformTheta(pdTheta,t_pdTheta,len,setP);
+    setHistory(t_pdTheta,-f,iter,setP,history);
+    f=fNew;
+    if (!setP->quiet) {
+      R_FlushConsole();
+      R_CheckUserInterrupt();
+    }
+  }
+  return iter-1;
+}
+
+/**
+ * Incremental EM (Neal and Hinton 1998), run ahead of the full iterations when there are
+ * very many areas. The areas are split once at random into blocks of batchSize, and the
+ * sufficient statistics are kept as the sum of the contributions of each block. After
+ * one pass that fills them at the starting theta, each iteration redoes the E-step of one
+ * block only, replaces its contribution and applies the M-step, so that its cost does not
+ * depend on the number of areas; passes such passes visit the blocks in random order.
+ * The statistics always average proper moments of every area, from which the M-step gives
+ * a proper theta. Each block is sorted so that its general, survey and homogeneous
+ * areas come in the order ecoEStep expects, and shares the tomography lines of params
+ * through caseP.id. The M-step has to depend on the sufficient statistics alone: not for
+ * NCAR with fixed rho, nor for hypothesis tests
+ * input: params, pdTheta
+ * mutates: pdTheta (params are left for the caller to set from it)
+ */
+void ecoIncrementalEM(Param* params, double* pdTheta, int batchSize, int passes) {
+  setParam* setP=params[0].setP;
+  setParam bsetP; //the block as a data set of its own
+  int t_samp=setP->t_samp, len=setP->suffstat_len, nblocks=(t_samp+batchSize-1)/batchSize;
+  int i,j,k,tmp,pass,b,blk;
+  int *perm=intArray(t_samp), *order=intArray(nblocks);
+  Param* bparams=(Param*) Calloc(batchSize,Param);
+  double **blockSuff=doubleMatrix(nblocks,len); //weighted sums of each block
+  double *bSuff=doubleArray(len+1), *Suff=doubleArray(len+1);
+
+  for(i=0;i<t_samp;i++) perm[i]=i;
+  for(i=t_samp-1;i>0;i--) { //Fisher-Yates shuffle
+    j=(int)(unif_rand()*(i+1));
+    tmp=perm[i]; perm[i]=perm[j]; perm[j]=tmp;
+  }
+  for(k=0;k<nblocks;k++) {
+    order[k]=k;
+    R_isort(perm+k*batchSize,imin2(batchSize,t_samp-k*batchSize));
+  }
+
+  for(pass=0;pass<=passes;pass++) {
+    for(k=nblocks-1;k>0 && pass>0;k--) {
+      j=(int)(unif_rand()*(k+1));
+      tmp=order[k]; order[k]=order[j]; order[j]=tmp;
+    }
+    for(k=0;k<nblocks;k++) {
+      blk=order[k];
+      b=imin2(batchSize,t_samp-blk*batchSize);
+      bsetP=*setP;
+      bsetP.t_samp=b; bsetP.n_samp=0; bsetP.s_samp=0; bsetP.x1_samp=0; bsetP.x0_samp=0;
+      bsetP.t_weight=0; bsetP.calcLoglik=0;
+      for(i=0;i<b;i++) {
+        tmp=perm[blk*batchSize+i];
+        bparams[i]=params[tmp];
+        bparams[i].setP=&bsetP;
+        bsetP.t_weight+=bparams[i].caseP.weight;
+        if (tmp<setP->n_samp) bsetP.n_samp++;
+        else if (tmp<setP->n_samp+setP->s_samp) bsetP.s_samp++;
+        else if (tmp<setP->n_samp+setP->s_samp+setP->x1_samp) bsetP.x1_samp++;
+        else bsetP.x0_samp++;
+      }
+      setParamsFromTheta(bparams,pdTheta);
+      for(j=0;j<setP->param_len;j++) bsetP.pdTheta[j]=pdTheta[j];
+      ecoEStep(bparams,bSuff);
+      for(j=0;j<len;j++) blockSuff[blk][j]=bSuff[j]*bsetP.t_weight;
+      //the first pass only fills the statistics at the starting theta
+      if (pass==0) continue;
+
+      for(j=0;j<len;j++) {
+        Suff[j]=0;
+        for(i=0;i<nblocks;i++) Suff[j]+=blockSuff[i][j];
+        Suff[j]/=setP->t_weight;
+      }
+      if (!setP->ncar)
+        ecoMStep(Suff,pdTheta,bparams);
+      else
+        ecoMStepNCAR(Suff,pdTheta,bparams);
+      if (setP->verbose>=1) {
+        Rprintf("block %d/%d:",(pass-1)*nblocks+k+1,passes*nblocks);
+        for(i=0;i<setP->param_len;i++)
+          if (setP->varParam[i]) {
+            if (pdTheta[i]>=0) Rprintf("% 5.3f",pdTheta[i]);
+            else Rprintf(" % 5.2f",pdTheta[i]);
+          }
+        Rprintf("\n");
+      }
+      R_CheckUserInterrupt();
+    }
+  }
+  free(perm); free(order);
+  Free(bparams); Free(bSuff); Free(Suff);
+  FreeMatrix(blockSuff,nblocks);
+}
+
 /**
  * CAR M-Step
  * inputs: Suff (sufficient statistics)
@@ -545,7 +1179,7 @@ void ecoMStep(double* Suff, double* pdTheta, Param* params) {
   setP->Sigma[1][0] = setP->Sigma[0][1];
 
   //if(setP->verbose>=3) Rprintf("Sigma mstep: %5g %5g %5g %5g\n",setP->Sigma[0][0],setP->Sigma[0][1],setP->Sigma[1][0],setP->Sigma[1][1]);
-  dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"regular M-step");
+  sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"regular M-step");
 
   /* assign each data point the new mu (same for all points) */
   for(i=0;i<setP->t_samp;i++) {
@@ -569,7 +1203,7 @@ void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params) {
   //double[3][3] Sigma3=setP->Sigma3;   /* covariance matrix*/
   //double[3][3] InvSigma3=setP->Sigma3;   /* inverse covariance matrix*/
   //int ii,i,j,verbose,t_samp;
-  int ii,i,j;
+  int ii,j;
   int verbose=0;
   int t_samp=0;
   verbose=t_samp;
@@ -630,52 +1264,26 @@ void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params) {
     //CODE BLOCK D
     //compute beta based on previous sigma
     //beta is mu1,beta1,mu2,beta, which are pdTheta 1,2,6,7
-    double **InvSigma=doubleMatrix(2,2);
-    double **Zmat=doubleMatrix(4,2);
-    double **Zmat_t=doubleMatrix(2,4);
-    double **tmp41=doubleMatrix(4,1);
-    double **tmp42=doubleMatrix(4,2);
-    double **tmp44=doubleMatrix(4,4);
-    double **tmp21=doubleMatrix(2,1);
-    double **denom=doubleMatrix(4,4);
-    double **numer=doubleMatrix(4,1);
-    for (i=0;i<4;i++) {
-      for(j=0;j<4;j++) {
-        if (j<2) {
-          if (i<2) InvSigma[i][j]=setP->InvSigma[i][j];
-          Zmat[i][j]=0; Zmat_t[j][i]=0;
-        }
-        denom[i][j]=0;
-      }
-      numer[i][0]=0;
-    }
-    //Rprintf("InvSigma %5g %5g %5g\n",InvSigma[0][0],InvSigma[1][1],InvSigma[0][1]);
+    //Z_i has the rows (1, lx_i-mu3) for both W1* and W2*, so the normal equations
+    //(sum Z_i InvSigma Z_i') beta = sum Z_i InvSigma W*_i factor as InvSigma x (sum z_i z_i')
+    //and reduce to the least squares of each W* on (1, lx-mu3), whatever Sigma is
+    double zz[3]={0,0,0}; //sums of w, w*u, w*u^2, u=lx-mu3
+    double zw[2][2]={{0,0},{0,0}}; //[j] sums of w*W_j*, w*u*W_j*
+    double w,u,det;
     for(ii=0;ii<setP->t_samp;ii++) {
-        double lx=logit(params[ii].caseP.X,"NCAR beta");
-        for(j=0;j<2;j++) {
-          Zmat_t[j][j*2+1]=lx - pdTheta[0];
-          Zmat_t[j][j*2]=1;
-          Zmat[j*2+1][j]=lx - pdTheta[0];
-          Zmat[j*2][j]=1;
-        }
-        matrixMul(Zmat,InvSigma,4,2,2,2,tmp42);
-        matrixMul(tmp42,Zmat_t,4,2,2,4,tmp44);
-        for (i=0;i<4;i++)
-          for(j=0;j<4;j++)
-            denom[i][j]+=tmp44[i][j];
-        //for (i=0;i<2;i++) tmp21[i][0]=(params[ii].caseP.Wstar[i] - pdTheta[i+1]); //Wtilde ??
-        for (i=0;i<2;i++) tmp21[i][0]=params[ii].caseP.Wstar[i]; //Wstar
-        //matrixMul(Zmat,InvSigma,4,2,2,2,tmp42);  //no need to repeat calculation
-        matrixMul(tmp42,tmp21,4,2,2,1,tmp41);
-        for (i=0;i<4;i++) numer[i][0]+=tmp41[i][0];
+      w=params[ii].caseP.weight;
+      u=logit(params[ii].caseP.X,"NCAR beta")-pdTheta[0];
+      zz[0]+=w; zz[1]+=w*u; zz[2]+=w*u*u;
+      for(j=0;j<2;j++) {
+        zw[j][0]+=w*params[ii].caseP.Wstar[j];
+        zw[j][1]+=w*u*params[ii].caseP.Wstar[j];
+      }
     }
-    dinv(denom,4,denom);
-    matrixMul(denom,numer,4,4,4,1,numer);
-
-    pdTheta[1]=numer[0][0]; //mu1
-    pdTheta[6]=numer[1][0]; //beta1
-    pdTheta[2]=numer[2][0]; //mu2
-    pdTheta[7]=numer[3][0]; //beta2
+    det=zz[0]*zz[2]-zz[1]*zz[1];
+    pdTheta[1]=(zz[2]*zw[0][0]-zz[1]*zw[0][1])/det; //mu1
+    pdTheta[6]=(zz[0]*zw[0][1]-zz[1]*zw[0][0])/det; //beta1
+    pdTheta[2]=(zz[2]*zw[1][0]-zz[1]*zw[1][1])/det; //mu2
+    pdTheta[7]=(zz[0]*zw[1][1]-zz[1]*zw[1][0])/det; //beta2
     //pdTheta[8] is constant
     //Rprintf("Compare Suff1 %5g to pdT1 %5g \n",Suff[1],pdTheta[1]);
     //Rprintf("Compare Suff2 %5g to pdT2 %5g \n",Suff[2],pdTheta[2]);
@@ -726,7 +1334,7 @@ void ecoMStepNCAR(double* Suff, double* pdTheta, Param* params) {
     setP->Sigma3[2][0] = setP->Sigma3[0][2];
     setP->Sigma3[2][1] = setP->Sigma3[1][2];
   }
-  dinv2D((double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"NCAR M-step S3");
+  sigmaInv(setP,(double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"NCAR M-step S3");
   initNCAR(params,pdTheta);
   if (setP->fixedRho) ncarFixedRhoUnTransform(pdTheta);
 }
@@ -747,48 +1355,33 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
   t_samp=verbose;
   verbose=setP->verbose;
   t_samp=setP->t_samp;
-  double **InvSigma=doubleMatrix(2,2);
-  double **Z_i=doubleMatrix(k,2);
-  double **Z_i_t=doubleMatrix(2,k);
-  double **tmpk1=doubleMatrix(k,1);
-  double **tmpk2=doubleMatrix(k,2);
-  double **tmpkk=doubleMatrix(k,k);
-  double **tmp21=doubleMatrix(2,1);
-  double **tmp21_b=doubleMatrix(2,1);
-  double **tmp12=doubleMatrix(1,2);
-  double **tmp22=doubleMatrix(2,2);
   double **denom=doubleMatrix(k,k);
-  double **numer=doubleMatrix(k,1);
-  //betas
+  double *numer=doubleArray(k);
+  double *beta=doubleArray(k);
+  double zp[2],e[2],w;
+  int l;
+  //betas: (sum Z_i InvSigma Z_i') beta = sum Z_i InvSigma W*_i, accumulated in one pass
   for (i=0;i<k;i++) {
-    for(j=0;j<k;j++) {
-      if (j<2) {
-        if (i<2) InvSigma[i][j]=setP->InvSigma[i][j];
-      }
-      denom[i][j]=0;
-    }
-    numer[i][0]=0;
+    for(j=0;j<k;j++) denom[i][j]=0;
+    numer[i]=0;
   }
-  //Rprintf("InvSigma %5g %5g %5g\n",InvSigma[0][0],InvSigma[1][1],InvSigma[0][1]);
-  for(ii=0;ii<setP->t_samp;ii++) {
+  for(ii=0;ii<t_samp;ii++) {
+    double **Z=params[ii].caseP.Z_i;
+    w=params[ii].caseP.weight;
     for (i=0;i<k;i++) {
-      for(j=0;j<k;j++) {
-        Z_i[i][j]=params[ii].caseP.Z_i[i][j];
-        Z_i_t[i][j]=params[ii].caseP.Z_i[j][i];
-      }
+      for (l=0;l<2;l++) zp[l]=Z[i][0]*setP->InvSigma[0][l]+Z[i][1]*setP->InvSigma[1][l];
+      for (j=0;j<=i;j++) denom[i][j]+=w*(zp[0]*Z[j][0]+zp[1]*Z[j][1]);
+      numer[i]+=w*(zp[0]*params[ii].caseP.Wstar[0]+zp[1]*params[ii].caseP.Wstar[1]);
     }
-      matrixMul(Z_i,InvSigma,k,2,2,2,tmpk2);
-      matrixMul(tmpk2,Z_i_t,k,2,2,k,tmpkk);
-      for (i=0;i<k;i++)
-        for(j=0;j<k;j++)
-          denom[i][j]+=tmpkk[i][j];
-      for (i=0;i<2;i++) tmp21[i][0]=params[ii].caseP.Wstar[i]; //Wstar
-      matrixMul(tmpk2,tmp21,k,2,2,1,tmpk1);
-      for (i=0;i<k;i++) numer[i][0]+=tmpk1[i][0];
   }
+  for (i=0;i<k;i++)
+    for (j=i+1;j<k;j++) denom[i][j]=denom[j][i];
   dinv(denom,k,denom);
-  matrixMul(denom,numer,k,k,k,1,numer);
-  for(i=0; i<k;i++) pdTheta[i]=numer[i][0]; //betas
+  for(i=0; i<k;i++) {
+    beta[i]=0;
+    for(j=0;j<k;j++) beta[i]+=denom[i][j]*numer[j];
+    pdTheta[i]=beta[i]; //betas
+  }
 
 
   if (setP->hypTest>0) {
@@ -802,22 +1395,19 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
       setP->Sigma[i][j] = 0;
 
 
-  for(ii=0;ii<setP->t_samp;ii++) {
-    for (i=0;i<k;i++) {
-      for(j=0;j<k;j++) {
-        Z_i_t[i][j]=params[ii].caseP.Z_i[j][i];
-      }
+  for(ii=0;ii<t_samp;ii++) {
+    double **Z=params[ii].caseP.Z_i;
+    w=params[ii].caseP.weight;
+    for (l=0;l<2;l++) { //Wstar - Z_t*B
+      e[l]=params[ii].caseP.Wstar[l];
+      for (i=0;i<k;i++) e[l]-=Z[i][l]*beta[i];
     }
-    matrixMul(Z_i_t,numer,2,k,k,1,tmp21_b);
-    for (i=0;i<2;i++) tmp21[i][0]=params[ii].caseP.Wstar[i]; //Wstar
-    for (i=0;i<2;i++) tmp21[i][0] = tmp21[i][0] - tmp21_b[i][0]; //Wstar - Z_t*B
-    for (i=0;i<2;i++) tmp12[0][i] = tmp21[i][0]; //invserse
-    matrixMul(tmp21,tmp12,2,1,1,2,tmp22);
     for(i=0; i<2;i++)
       for(j=0; j<2;j++)
-        setP->Sigma[i][j] += tmp22[i][j];
+        setP->Sigma[i][j] += w*e[i]*e[j];
   }
-  dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"CCAR M-step S2");
+  FreeMatrix(denom,k); Free(numer); Free(beta);
+  sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"CCAR M-step S2");
 
   //variances
   //CODE BLOCK B
@@ -837,7 +1427,7 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
   setP->Sigma3[2][0] = setP->Sigma3[0][2];
   setP->Sigma3[2][1] = setP->Sigma3[1][2];
 
-  dinv2D((double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"NCAR M-step S3");
+  sigmaInv(setP,(double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"NCAR M-step S3");
   initNCAR(params,pdTheta);
 
 }
@@ -846,51 +1436,37 @@ void ecoMStepCCAR(double* pdTheta, Param* params) {
  * Exta M-Step for hypothesis testing
  * Input: params
  * Mutates pdTheta
+ * With a single constraint c (see hypTestCoeff), the offset of the means is
+ * Sigma c (c' sum W* - n*hypTestResult) / (n c' Sigma c); computed in place, without
+ * allocating, since the M-step may run off the main thread (see ecoSEM)
  */
 void MStepHypTest(Param* params, double* pdTheta) {
   setParam* setP=params[0].setP;
-  double offset,denom;
-  int dim,i,j,l,k;
+  double offset,denom,excess,sumW[3]={0,0,0},SigmaC[3];
+  double *Sigma=setP->ncar ? &(setP->Sigma3[0][0]) : &(setP->Sigma[0][0]);
+  int dim,i,k;
   dim=setP->ncar ? 3 : 2;
-  l=setP->hypTest;
-  double** Sigma=doubleMatrix(dim,dim);
-  double** temp_LbyD=doubleMatrix(l,dim);
-  double** temp_DbyL=doubleMatrix(dim,l);
-  double** temp_LbyL=doubleMatrix(l,l);
-
-  for(i=0;i<dim;i++)
-    for(j=0;j<dim;j++) {
-      if (dim==3) {
-        Sigma[i][j]=setP->Sigma3[i][j];
-      }
-      else {
-        Sigma[i][j]=setP->Sigma[i][j];
-      }
-    }
-  //transpose
-  double** hypTestCoeffT=doubleMatrix(l,dim);
-  for(i=0;i<dim;i++) hypTestCoeffT[0][i]=setP->hypTestCoeff[i][0];
 
   //numerator
-  for(k=0;k<2;k++) temp_DbyL[k][0]=0;
   for(i=0;i<setP->t_samp;i++) {
-    temp_DbyL[0][0]+=params[i].caseP.Wstar[0];
-    temp_DbyL[1][0]+=params[i].caseP.Wstar[1];
+    sumW[0]+=params[i].caseP.weight*params[i].caseP.Wstar[0];
+    sumW[1]+=params[i].caseP.weight*params[i].caseP.Wstar[1];
   }
-  matrixMul(hypTestCoeffT,temp_DbyL,l,dim,dim,l,temp_LbyL);
-  temp_LbyL[0][0]=temp_LbyL[0][0]-(setP->t_samp*setP->hypTestResult);
-  matrixMul(Sigma,setP->hypTestCoeff,dim,dim,dim,l,temp_DbyL);
-  for(k=0;k<2;k++) temp_DbyL[k][0]*=temp_LbyL[0][0];
+  excess=-setP->t_weight*setP->hypTestResult;
+  for(k=0;k<dim;k++) excess+=setP->hypTestCoeff[k][0]*sumW[k];
 
   //denominator
-  //matrixMul(hypTestCoeffT,InvSigma,l,dim,dim,dim,temp_LbyD);
-  matrixMul(hypTestCoeffT,Sigma,l,dim,dim,dim,temp_LbyD);
-  matrixMul(temp_LbyD,setP->hypTestCoeff,l,dim,dim,l,temp_LbyL);
-  denom=setP->t_samp*temp_LbyL[0][0];
+  denom=0;
+  for(k=0;k<dim;k++) {
+    SigmaC[k]=0;
+    for(i=0;i<dim;i++) SigmaC[k]+=Sigma[k*dim+i]*setP->hypTestCoeff[i][0];
+    denom+=setP->hypTestCoeff[k][0]*SigmaC[k];
+  }
+  denom*=setP->t_weight;
 
   //offset theta
   for(k=0;k<2;k++) {
-    offset=temp_DbyL[k][0]/denom;
+    offset=SigmaC[k]*excess/denom;
     int kindex= (setP->ncar) ? (k+1) : k;
     pdTheta[kindex]=pdTheta[kindex]-offset;
   }
@@ -915,7 +1491,7 @@ void initNCAR(Param* params, double* pdTheta) {
     setP->Sigma[0][1]= (pdTheta[8] - pdTheta[6]*pdTheta[7])/sqrt((1 - pdTheta[6]*pdTheta[6])*(1 - pdTheta[7]*pdTheta[7])); //correlation
     setP->Sigma[0][1]= setP->Sigma[0][1]*sqrt(setP->Sigma[0][0]*setP->Sigma[1][1]); //covar
     setP->Sigma[1][0]= setP->Sigma[0][1]; //symmetry
-    dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
+    sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
 
     //assign each data point the new mu (different for each point)
     for(i=0;i<setP->t_samp;i++) {
@@ -933,7 +1509,7 @@ void initNCAR(Param* params, double* pdTheta) {
     setP->Sigma[1][1]= pdTheta[5];
     setP->Sigma[0][1]= pdTheta[8]*sqrt(pdTheta[4]*pdTheta[5]); //covar
     setP->Sigma[1][0]= setP->Sigma[0][1]; //symmetry
-    dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
+    sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
 
     for(i=0;i<setP->t_samp;i++) {
       params[i].caseP.mu[0]=pdTheta[1] + pdTheta[6]*(logit(params[i].caseP.X,"initNCAR mu0")-pdTheta[0]);
@@ -963,7 +1539,7 @@ void initCCAR(Param* params, double* pdTheta) {
     setP->Sigma[0][1]= (pdTheta[8] - pdTheta[6]*pdTheta[7])/sqrt((1 - pdTheta[6]*pdTheta[6])*(1 - pdTheta[7]*pdTheta[7])); //correlation
     setP->Sigma[0][1]= setP->Sigma[0][1]*sqrt(setP->Sigma[0][0]*setP->Sigma[1][1]); //covar
     setP->Sigma[1][0]= setP->Sigma[0][1]; //symmetry
-    dinv2D((double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
+    sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])),"NCAR M-step S2");
     //assign each data point the new mu (different for each point)
     for(i=0;i<setP->t_samp;i++) {
       params[i].caseP.mu[0]=pdTheta[1] + pdTheta[6]*sqrt(pdTheta[4]/pdTheta[3])*(logit(params[i].caseP.X,"initNCAR mu0")-pdTheta[0]);
@@ -977,160 +1553,203 @@ void initCCAR(Param* params, double* pdTheta) {
   }
 }
 
+/**
+ * Inverts Sigma (or Sigma3) as dinv2D. While setP->quiet the M-step may be running off
+ * the main thread (see ecoSEM), where error() cannot be called: the first failure is
+ * kept in setP instead, for the caller to raise with dinv2DFail once back on the main thread
+ * mutates: InvSigma, setP->invErr
+ */
+void sigmaInv(setParam* setP, double* Sigma, int size, double* InvSigma, char* emsg) {
+  int step, errorM;
+  if (!setP->quiet) {
+    dinv2D(Sigma,size,InvSigma,emsg);
+    return;
+  }
+  errorM=dinv2Dinfo(Sigma,size,InvSigma,&step);
+  if (errorM && !setP->invErr) {
+    setP->invErr=errorM;
+    setP->invErrStep=step;
+    setP->invErrMsg=emsg;
+  }
+}
+
+/**
+ * Sets mu and Sigma (and Sigma3 under NCAR) of every area from theta
+ * note that for fixed rho, the input is the UNTRANSFORMED PARAMETERS
+ * input: pdTheta
+ * mutates: params
+ */
+void setParamsFromTheta(Param* params, double* pdTheta) {
+  setParam* setP=params[0].setP;
+  int i;
+  if (!setP->ncar) {
+    for(i=0;i<setP->t_samp;i++) {
+      params[i].caseP.mu[0] = pdTheta[0];
+      params[i].caseP.mu[1] = pdTheta[1];
+    }
+    setP->Sigma[0][0] = pdTheta[2];
+    setP->Sigma[1][1] = pdTheta[3];
+    setP->Sigma[0][1] = pdTheta[4]*sqrt(pdTheta[2]*pdTheta[3]);
+    setP->Sigma[1][0] = setP->Sigma[0][1];
+    sigmaInv(setP,(double*)(&(setP->Sigma[0][0])), 2, (double*)(&(setP->InvSigma[0][0])), "CAR init");
+  }
+  else {
+    //reference: (0) mu_3, (1) mu_1, (2) mu_2, (3) sig_3, (4) sig_1, (5) sig_2, (6) r_13, (7) r_23, (8) r_12
+    setP->Sigma3[0][0] = pdTheta[4];
+    setP->Sigma3[1][1] = pdTheta[5];
+    setP->Sigma3[2][2] = pdTheta[3];
+
+    //covariances
+    setP->Sigma3[0][1] = pdTheta[8]*sqrt(pdTheta[4]*pdTheta[5]);
+    setP->Sigma3[0][2] = pdTheta[6]*sqrt(pdTheta[4]*pdTheta[3]);
+    setP->Sigma3[1][2] = pdTheta[7]*sqrt(pdTheta[5]*pdTheta[3]);
+
+    //symmetry
+    setP->Sigma3[1][0] = setP->Sigma3[0][1];
+    setP->Sigma3[2][0] = setP->Sigma3[0][2];
+    setP->Sigma3[2][1] = setP->Sigma3[1][2];
+    sigmaInv(setP,(double*)(&(setP->Sigma3[0][0])), 3, (double*)(&(setP->InvSigma3[0][0])),"NCAR Sig3 init");
+    if (setP->fixedRho) ncarFixedRhoTransform(pdTheta);
+    initNCAR(params,pdTheta);
+    if (setP->fixedRho) ncarFixedRhoUnTransform(pdTheta);
+  }
+}
+
 /**
  * input: optTheta,pdTheta,params,Rmat
  * mutate/output: matrices Rmat and Rmat_old (dimensions of param_len x param_len)
  * optTheta is optimal theta
  * pdTheta is current theta
  * Rmat_old contains the input Rmat
+ * The rows that are not done yet are independent given optTheta, so each gets its own copy
+ * of setParam and of the areas, and their EM steps run in parallel. These E-steps print
+ * nothing (see setParam.quiet): their integration errors are printed afterwards, row by row
  */
  void ecoSEM(double* optTheta, double* pdTheta, Param* params, double Rmat_old[7][7], double Rmat[7][7]) {
   //assume we have optTheta, ie \hat{phi}
   //pdTheta is phi^{t+1}
-  int i,j,verbose,len,param_len;
-  setParam setP_sem=*(params[0].setP);
-  param_len=setP_sem.param_len;
-  double *SuffSem=doubleArray(setP_sem.suffstat_len+1); //sufficient stats
-  double phiTI[param_len]; //phi^t_i
-  double phiTp1I[param_len]; //phi^{t+1}_i
+  int i,j,k,verbose,len,param_len,t_samp,nrows;
+  setParam* setP=params[0].setP;
+  param_len=setP->param_len;
+  t_samp=setP->t_samp;
+  verbose=setP->verbose;
   double t_optTheta[param_len]; //transformed optimal
   double t_phiTI[param_len]; //transformed phi^t_i
   double t_phiTp1I[param_len]; //transformed phi^{t+1}_i
-  Param* params_sem=(Param*) Calloc(params->setP->t_samp,Param);
-  verbose=setP_sem.verbose;
+  int row[7]; //rows of the R matrix still to do
+  int switch_index[7]; //index in theta of the parameter that is moved in that row
   //determine length of R matrix
   len=0;
   for(j=0; j<param_len;j++)
-    if(setP_sem.varParam[j]) len++;
+    if(setP->varParam[j]) len++;
 
   //first, save old Rmat
   for(i=0;i<len;i++)
     for(j=0;j<len;j++)
       Rmat_old[i][j]=Rmat[i][j];
 
+  nrows=0;
   for(i=0;i<len;i++) {
-    if (!setP_sem.semDone[i]) { //we're not done with this row
-      //step 1: set phi^t_i
-      if (verbose>=2) Rprintf("Theta(%d):",(i+1));
-      int switch_index_ir=0; int switch_index_it=0;
-      for(j=0;j<param_len;j++) {
-        if (!setP_sem.varParam[j]) //const
-          phiTI[j]=optTheta[j];
-        else {
-          if (i==switch_index_ir) {
-            phiTI[j]=pdTheta[j]; //current value
-            switch_index_it=j;
-          }
-          else phiTI[j]=optTheta[j]; //optimal value
-          switch_index_ir++;
-        }
-        if (verbose>=2) Rprintf(" %5g ", phiTI[j]);
-      }
-      //if (setP_sem.fixedRho) {
-      //  phiTI[len-1]=pdTheta[len-1];
-      //  phiTp1I[len-1]=pdTheta[len-1];
-      // if (verbose>=2) Rprintf(" %5g ", phiTI[len-1]);
-      //}
-      if (verbose>=2) Rprintf("\n");
-      for(j=0;j<param_len;j++) phiTp1I[j]=phiTI[j]; //init next iteration
-
-      //step 2: run an E-step and an M-step with phi^t_i
-      //initialize params
-      if (!setP_sem.ncar) {
-        for(j=0;j<setP_sem.t_samp;j++) {
-          params_sem[j].setP=&setP_sem;
-          params_sem[j].caseP=params[j].caseP;
-          params_sem[j].caseP.mu[0] = phiTI[0];
-          params_sem[j].caseP.mu[1] = phiTI[1];
-        }
-        setP_sem.Sigma[0][0] = phiTI[2];
-        setP_sem.Sigma[1][1] = phiTI[3];
-        setP_sem.Sigma[0][1] = phiTI[4]*sqrt(phiTI[2]*phiTI[3]);
-        setP_sem.Sigma[1][0] = setP_sem.Sigma[0][1];
-        dinv2D((double*)(&(setP_sem.Sigma[0][0])), 2, (double*)(&(setP_sem.InvSigma[0][0])), "SEM: CAR init ");
-      }
-      else {
-        for(j=0;j<setP_sem.t_samp;j++) {
-          params_sem[j].setP=&setP_sem;
-          params_sem[j].caseP=params[j].caseP;
-        }
-        setP_sem.Sigma3[0][0] = phiTI[4];
-        setP_sem.Sigma3[1][1] = phiTI[5];
-        setP_sem.Sigma3[2][2] = phiTI[3];
-
-        //covariances
-        setP_sem.Sigma3[0][1] = phiTI[8]*sqrt(phiTI[4]*phiTI[5]);
-        setP_sem.Sigma3[0][2] = phiTI[6]*sqrt(phiTI[4]*phiTI[3]);
-        setP_sem.Sigma3[1][2] = phiTI[7]*sqrt(phiTI[5]*phiTI[3]);
-
-        //symmetry
-        setP_sem.Sigma3[1][0] = setP_sem.Sigma3[0][1];
-        setP_sem.Sigma3[2][0] = setP_sem.Sigma3[0][2];
-        setP_sem.Sigma3[2][1] = setP_sem.Sigma3[1][2];
-        if (verbose>=2) {
-          Rprintf("Sigma3: %5g %5g %5g %5g %5g %5g; %5g %5g\n",setP_sem.Sigma3[0][0],setP_sem.Sigma3[0][1],setP_sem.Sigma3[1][1],setP_sem.Sigma3[0][2],setP_sem.Sigma3[1][2],setP_sem.Sigma3[2][2],*(&(setP_sem.Sigma3[0][0])+0),*(&(setP_sem.Sigma3[0][0])+8));
-        }
-        dinv2D((double*)(&(setP_sem.Sigma3[0][0])), 3, (double*)(&(setP_sem.InvSigma3[0][0])),"SEM: NCAR Sig3 init");
-        if (verbose>=2) {
-          Rprintf("Check 1");
-        }
-        if (setP_sem.fixedRho) ncarFixedRhoTransform(phiTI);
-        initNCAR(params_sem,phiTI);
-        if (setP_sem.fixedRho) ncarFixedRhoUnTransform(phiTI);
-        if (verbose>=2) {
-          Rprintf("Check 2");
-        }
-      }
-
-      //if (verbose>=2) {
-      //  Rprintf("Sigma: %5g %5g %5g %5g\n",setP_sem.Sigma[0][0],setP_sem.Sigma[0][1],setP_sem.Sigma[1][0],setP_sem.Sigma[1][1]);
-      //}
+    if (!setP->semDone[i]) row[nrows++]=i; //we're not done with this row
+    else { //keep row the same
+      for(j = 0; j<len; j++)
+        Rmat[i][j]=Rmat_old[i][j];
+    }
+  }
 
-      ecoEStep(params_sem, SuffSem);
-      if (!params[0].setP->ncar)
-        ecoMStep(SuffSem,phiTp1I,params_sem);
-      else
-        ecoMStepNCAR(SuffSem,phiTp1I,params_sem);
-
-      //step 3: create new R matrix row
-      transformTheta(phiTp1I,t_phiTp1I,setP_sem.param_len,&setP_sem);
-      transformTheta(optTheta,t_optTheta,setP_sem.param_len,&setP_sem);
-      transformTheta(phiTI,t_phiTI,setP_sem.param_len,&setP_sem);
-      /*if (verbose>=2) {
-        Rprintf("T+1:");
-        for (j=0;j<param_len;j++) Rprintf(" %5g ", phiTp1I[j]);
-        Rprintf("\nOpt:");
-        for (j=0;j<param_len;j++) Rprintf(" %5g ", optTheta[j]);
-        Rprintf("\n 2nd item: %5g %5g %5g %5g", t_phiTp1I[2], t_optTheta[2], t_phiTI[switch_index_it], t_optTheta[switch_index_it]);
-      }*/
-      int index_jr=0;
-      for(j = 0; j<param_len; j++) {
-        if (setP_sem.varParam[j]) {
-          Rmat[i][index_jr]=(t_phiTp1I[j]-t_optTheta[j])/(t_phiTI[switch_index_it]-t_optTheta[switch_index_it]);
-          index_jr++;
+  double **phiTI=doubleMatrix(nrows,param_len); //phi^t_i
+  double **phiTp1I=doubleMatrix(nrows,param_len); //phi^{t+1}_i
+  double **SuffSem=doubleMatrix(nrows,setP->suffstat_len+1); //sufficient stats
+  setParam* setP_sem=(setParam*) Calloc(nrows,setParam);
+  Param** params_sem=(Param**) Calloc(nrows,Param*);
+
+  //step 1: set phi^t_i
+  for(k=0;k<nrows;k++) {
+    i=row[k];
+    if (verbose>=2) Rprintf("Theta(%d):",(i+1));
+    int switch_index_ir=0;
+    for(j=0;j<param_len;j++) {
+      if (!setP->varParam[j]) //const
+        phiTI[k][j]=optTheta[j];
+      else {
+        if (i==switch_index_ir) {
+          phiTI[k][j]=pdTheta[j]; //current value
+          switch_index[k]=j;
         }
+        else phiTI[k][j]=optTheta[j]; //optimal value
+        switch_index_ir++;
       }
+      if (verbose>=2) Rprintf(" %5g ", phiTI[k][j]);
+    }
+    if (verbose>=2) Rprintf("\n");
+    for(j=0;j<param_len;j++) phiTp1I[k][j]=phiTI[k][j]; //init next iteration
+
+    //the R matrix only needs theta, so the rows skip the log-likelihood
+    setP_sem[k]=*setP;
+    setP_sem[k].pdTheta=doubleArray(param_len);
+    setP_sem[k].calcLoglik=0;
+    setP_sem[k].quiet=1;
+    params_sem[k]=(Param*) Calloc(t_samp,Param);
+    for(j=0;j<t_samp;j++) {
+      params_sem[k][j].setP=&setP_sem[k];
+      params_sem[k][j].caseP=params[j].caseP;
+    }
+  }
 
-      //step 4: check for difference
-      params[0].setP->semDone[i]=closeEnough((double*)Rmat[i],(double*)Rmat_old[i],len,sqrt(params[0].setP->convergence));
-
+  //step 2: run an E-step and an M-step with phi^t_i
+  //with a single row left, its E-step uses the threads instead
+  //a singular Sigma is only reported here, back on the main thread (see sigmaInv)
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(dynamic,1) if(nrows>1) num_threads(setP->threads>0 ? setP->threads : omp_get_max_threads())
+#endif
+  for(k=0;k<nrows;k++) {
+    setParamsFromTheta(params_sem[k],phiTI[k]);
+    if (!setP_sem[k].invErr) ecoEMStep(params_sem[k],SuffSem[k],phiTp1I[k]);
+  }
+  for(k=0;k<nrows;k++)
+    if (setP_sem[k].invErr)
+      dinv2DFail(setP_sem[k].invErr,setP_sem[k].invErrStep,setP_sem[k].invErrMsg);
+
+  transformTheta(optTheta,t_optTheta,param_len,setP);
+  for(k=0;k<nrows;k++) {
+    i=row[k];
+    if (verbose>=2 && setP->ncar) {
+      Rprintf("Sigma3: %5g %5g %5g %5g %5g %5g\n",setP_sem[k].Sigma3[0][0],setP_sem[k].Sigma3[0][1],setP_sem[k].Sigma3[1][1],setP_sem[k].Sigma3[0][2],setP_sem[k].Sigma3[1][2],setP_sem[k].Sigma3[2][2]);
     }
-    else { //keep row the same
-      for(j = 0; j<len; j++)
-        Rmat[i][j]=Rmat_old[i][j];
+    for(j=0;j<t_samp;j++) printIntegrationError(&(params_sem[k][j]));
+
+    //step 3: create new R matrix row
+    transformTheta(phiTp1I[k],t_phiTp1I,param_len,setP);
+    transformTheta(phiTI[k],t_phiTI,param_len,setP);
+    int index_jr=0;
+    for(j = 0; j<param_len; j++) {
+      if (setP->varParam[j]) {
+        Rmat[i][index_jr]=(t_phiTp1I[j]-t_optTheta[j])/(t_phiTI[switch_index[k]]-t_optTheta[switch_index[k]]);
+        index_jr++;
+      }
     }
+
+    //step 4: check for difference
+    setP->semDone[i]=closeEnough((double*)Rmat[i],(double*)Rmat_old[i],len,sqrt(setP->convergence));
   }
   if(verbose>=1) {
     for(i=0;i<len;i++) {
-      Rprintf("\nR Matrix row %d (%s): ", (i+1), (params[0].setP->semDone[i]) ? "    Done" : "Not done");
+      Rprintf("\nR Matrix row %d (%s): ", (i+1), (setP->semDone[i]) ? "    Done" : "Not done");
       for(j=0;j<len;j++) {
         Rprintf(" %5.2f ",Rmat[i][j]);
       }
     }
     Rprintf("\n\n");
   }
-  Free(SuffSem);
+  for(k=0;k<nrows;k++) {
+    Free(setP_sem[k].pdTheta);
+    Free(params_sem[k]);
+  }
+  Free(setP_sem);
   Free(params_sem);
+  FreeMatrix(phiTI,nrows);
+  FreeMatrix(phiTp1I,nrows);
+  FreeMatrix(SuffSem,nrows);
 }
 
 
@@ -1140,12 +1759,13 @@ void initCCAR(Param* params, double* pdTheta) {
  * inputs:
  *   ndim: number of dimensions
  *   pdX: non-survey, non-homogenous data (length n_samp)
+ *   pdWeight: number of identical areas behind each row of pdX (length n_samp)
  *   sur_W: survey data (length s_samp)
  *   x1_W1: homogenous data (X==1) (length x1_samp)
  *   x0_W2: homogenous data (X==0) (length x0_samp)
  * mutates: params
  */
- void readData(Param* params, int n_dim, double* pdX, double* sur_W, double* x1_W1, double* x0_W2,
+ void readData(Param* params, int n_dim, double* pdX, double* pdWeight, double* sur_W, double* x1_W1, double* x0_W2,
                 int n_samp, int s_samp, int x1_samp, int x0_samp) {
      /* read the data set */
   int itemp,i,j,surv_dim;
@@ -1159,8 +1779,12 @@ void initCCAR(Param* params, double* pdTheta) {
       params[i].caseP.data[j] = pdX[itemp++];
     }
 
+  setP->t_weight=0;
   for (i = 0; i < n_samp; i++) {
     params[i].caseP.dataType=DPT_General;
+    params[i].caseP.intErr=0;
+    params[i].caseP.weight=pdWeight[i];
+    setP->t_weight+=pdWeight[i];
     params[i].caseP.X=params[i].caseP.data[0];
     params[i].caseP.Y=params[i].caseP.data[1];
     //fix X edge cases
@@ -1168,6 +1792,8 @@ void initCCAR(Param* params, double* pdTheta) {
     //fix Y edge cases
     params[i].caseP.Y=(params[i].caseP.Y >= 1) ? .9999 : ((params[i].caseP.Y <= 0) ? 0.0001 : params[i].caseP.Y);
   }
+  //the tomography lines only depend on the data: compute them once
+  initAreaLines(params,n_samp);
 
   /*read the survey data */
   itemp=0;
@@ -1176,6 +1802,9 @@ void initCCAR(Param* params, double* pdTheta) {
     for (i=n_samp; i<n_samp+s_samp; i++) {
       dtemp=sur_W[itemp++];
       params[i].caseP.dataType=DPT_Survey;
+      params[i].caseP.intErr=0;
+      params[i].caseP.weight=1;
+      params[i].caseP.id=i;
       if (j<n_dim) {
         params[i].caseP.W[j]=(dtemp == 1) ? .9999 : ((dtemp==0) ? .0001 : dtemp);
         params[i].caseP.Wstar[j]=logit(params[i].caseP.W[j],"Survey read");
@@ -1187,23 +1816,33 @@ void initCCAR(Param* params, double* pdTheta) {
     }
   }
 
-  /*read homeogenous areas information */
+  setP->t_weight+=s_samp;
+
+  /*read homeogenous areas information: W1 (X=1) or W2 (X=0) is Y */
   for (i=n_samp+s_samp; i<n_samp+s_samp+x1_samp; i++) {
-    /*params[i].caseP.dataType=DPT_Homog_X1;
-    params[i].caseP.W[0]=(x1_W1[i] == 1) ? .9999 : ((x1_W1[i]==0) ? .0001 : x1_W1[i]);
-    params[i].caseP.Wstar[0]=logit(params[i].caseP.W[0],"X1 read");*/
+    itemp=i-n_samp-s_samp;
+    params[i].caseP.dataType=DPT_Homog_X1;
+    params[i].caseP.intErr=0;
+    params[i].caseP.id=i;
+    params[i].caseP.weight=1;
+    params[i].caseP.X=1;
+    params[i].caseP.W[0]=(x1_W1[itemp] == 1) ? .9999 : ((x1_W1[itemp]==0) ? .0001 : x1_W1[itemp]);
+    params[i].caseP.Y=params[i].caseP.W[0];
+    params[i].caseP.Wstar[0]=logit(params[i].caseP.W[0],"X1 read");
   }
 
   for (i=n_samp+s_samp+x1_samp; i<n_samp+s_samp+x1_samp+x0_samp; i++) {
-    /*params[i].caseP.dataType=DPT_Homog_X0;
-    params[i].caseP.W[1]=(x0_W2[i] == 1) ? .9999 : ((x0_W2[i]==0) ? .0001 : x0_W2[i]);
-    params[i].caseP.Wstar[1]=logit(params[i].caseP.W[1],"X0 read");*/
-  }
-
-  /*Current version of program does not handle homogenous data*/
-  if ((x1_samp+x0_samp)>0) {
-    Rprintf("WARNING: Homogenous data is ignored and not handled by the current version of eco.");
+    itemp=i-n_samp-s_samp-x1_samp;
+    params[i].caseP.dataType=DPT_Homog_X0;
+    params[i].caseP.intErr=0;
+    params[i].caseP.id=i;
+    params[i].caseP.weight=1;
+    params[i].caseP.X=0;
+    params[i].caseP.W[1]=(x0_W2[itemp] == 1) ? .9999 : ((x0_W2[itemp]==0) ? .0001 : x0_W2[itemp]);
+    params[i].caseP.Y=params[i].caseP.W[1];
+    params[i].caseP.Wstar[1]=logit(params[i].caseP.W[1],"X0 read");
   }
+  setP->t_weight+=x1_samp+x0_samp;
 
 
   if (setP->verbose>=2) {
@@ -1354,15 +1993,70 @@ void ncarFixedRhoTransform(double* pdTheta) {
 
 
 /**
- * Input transformed theta, loglikelihood, iteration
- * Mutates: history_full
+ * Maps theta to the unconstrained coordinates in which SQUAREM extrapolates
+ * These are those of transformTheta, except under NCAR with fixed rho: there theta is
+ * first conditioned on X (see ncarFixedRhoTransform), so that r_12 | 3 is left alone
+ * input: pdTheta
+ * mutates: a_pdTheta
  **/
-void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double history_full[][10]) {
-  int len=setP->param_len;
+void thetaToAccel(double* pdTheta, double* a_pdTheta, setParam* setP) {
+  int i;
+  if (setP->ncar && setP->fixedRho) {
+    for (i=0;i<9;i++) a_pdTheta[i]=pdTheta[i];
+    ncarFixedRhoTransform(a_pdTheta);
+    for (i=3;i<6;i++) a_pdTheta[i]=log(a_pdTheta[i]);
+  }
+  else transformTheta(pdTheta,a_pdTheta,setP->param_len,setP);
+}
+
+/**
+ * Inverse of thetaToAccel
+ * input: a_pdTheta
+ * mutates: pdTheta
+ **/
+void accelToTheta(double* a_pdTheta, double* pdTheta, setParam* setP) {
+  int i;
+  if (setP->ncar && setP->fixedRho) {
+    for (i=0;i<9;i++) pdTheta[i]=a_pdTheta[i];
+    for (i=3;i<6;i++) pdTheta[i]=exp(pdTheta[i]);
+    ncarFixedRhoUnTransform(pdTheta);
+  }
+  else untransformTheta(a_pdTheta,pdTheta,setP->param_len,setP);
+}
+
+/**
+ * Whether theta is a proper parameter: finite, with positive variances and
+ * a positive definite correlation matrix
+ **/
+int validTheta(double* pdTheta, setParam* setP) {
+  int i;
+  for (i=0;i<setP->param_len;i++)
+    if (!R_FINITE(pdTheta[i])) return 0;
+  if (!setP->ncar)
+    return (pdTheta[2]>0 && pdTheta[3]>0 && fabs(pdTheta[4])<1);
+  if (pdTheta[3]<=0 || pdTheta[4]<=0 || pdTheta[5]<=0) return 0;
+  for (i=6;i<9;i++)
+    if (fabs(pdTheta[i])>=1) return 0;
+  return (1 - pdTheta[6]*pdTheta[6] - pdTheta[7]*pdTheta[7] - pdTheta[8]*pdTheta[8]
+          + 2*pdTheta[6]*pdTheta[7]*pdTheta[8] > 0);
+}
+
+/**
+ * Input transformed theta of iteration iter and the loglikelihood of iteration iter-1
+ * (which the E-step of iteration iter computes)
+ * Only every setP->historyEvery-th iteration gets a row, of param_len+1 values
+ * Mutates: history, setP->historyRows
+ **/
+void setHistory(double* t_pdTheta, double loglik, int iter,setParam* setP,double* history) {
+  int len=setP->param_len, every=setP->historyEvery;
   int j;
-  for(j=0;j<len;j++)
-    history_full[iter][j]=t_pdTheta[j];
-  if (iter>0) history_full[iter-1][len]=loglik;
+  if (iter>0 && (iter-1)%every==0)
+    history[((iter-1)/every)*(len+1)+len]=loglik;
+  if (iter%every==0) {
+    for(j=0;j<len;j++)
+      history[(iter/every)*(len+1)+j]=t_pdTheta[j];
+    setP->historyRows=iter/every+1;
+  }
 }
 
 /**
@@ -1378,6 +2072,25 @@ int closeEnough(double* pdTheta, double* pdTheta_old, int len, double maxerr) {
   return 1;
 }
 
+/* E-step tolerance as a fraction of the last change of theta */
+static const double intTolStep=1e-2;
+/* loosest E-step tolerance, also used for the first iteration */
+static const double intTolMax=1e-6;
+
+/**
+ * Tolerance of the E-step integrals for the next EM iteration, given the transformed theta
+ * before and after the last one: while theta still moves a lot, accurate moments are wasted,
+ * so the tolerance follows the largest change, between INT_Tol and intTolMax.
+ * len=0 gives the tolerance of the first iteration
+ **/
+double ecoIntTol(double* t_pdTheta, double* t_pdTheta_old, int len) {
+  double delta=0;
+  int j;
+  if (len==0) return intTolMax;
+  for(j=0;j<len;j++) delta=fmax2(delta,fabs(t_pdTheta[j]-t_pdTheta_old[j]));
+  return fmin2(intTolMax,fmax2(INT_Tol,intTolStep*delta));
+}
+
 /**
  * Is the SEM process completely done.
  **/
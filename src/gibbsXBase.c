@@ -209,9 +209,9 @@ void cBaseecoX(
       if ( X[i][1]!=0 && X[i][1]!=1 ) {
 	if (*Grid)
 	  rGrid(W[i], W1g[i],W2g[i], n_grid[i], mu_w, InvSigma_w,
-		n_dim);
+		n_dim, NULL);
 	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu_w, InvSigma_w, n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i], mu_w, InvSigma_w, n_dim, NULL);
       } 
       /*3 compute Wsta_i from W_i*/
       Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
@@ -239,7 +239,7 @@ void cBaseecoX(
       }
     
     /* update mu, Sigma given wstar using effective sample of Wstar */
-    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim+1);
+    NIWupdate(Wstar, mu, Sigma, InvSigma, mu0, tau0, nu0, S0, t_samp, n_dim+1, NULL, NULL);
     
     /*store Gibbs draw after burn-in and every nth draws */      
     R_CheckUserInterrupt();
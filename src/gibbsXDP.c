@@ -261,10 +261,10 @@ void cDPecoX(
 	/*2 sample W_i on the ith tomo line */
 
 	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu_w, InvSigma_w, n_dim);
+	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu_w, InvSigma_w, n_dim, NULL);
 	else {
 
-	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu_w, InvSigma_w, n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i],  mu_w, InvSigma_w, n_dim, NULL);
 
 	}
       }	  
@@ -318,7 +318,7 @@ void cDPecoX(
       onedata[0][0] = Wstar[i][0];
       onedata[0][1] = Wstar[i][1];
       onedata[0][2] = Wstar[i][2];
-      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim+1);
+      NIWupdate(onedata, mu[i], Sigma[i], InvSigma[i], mu0, tau0,nu0, S0, 1, n_dim+1, NULL, NULL);
       C[i]=nstar;
       nstar++;
        }
@@ -359,7 +359,7 @@ void cDPecoX(
     /* nj records the # of obs in Psimix */
 
     /** posterior update for mu_mix, Sigma_mix based on Psimix **/
-    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, (n_dim+1)); 
+    NIWupdate(Wstarmix, mu_mix,Sigma_mix, InvSigma_mix, mu0, tau0, nu0, S0, nj, (n_dim+1), NULL, NULL); 
 
     /**update mu, Simgat with mu_mix, Sigmat_mix via label**/
     for (j=0;j<nj;j++){
@@ -4,19 +4,28 @@
 #include <math.h>
 #include <Rmath.h>
 #include <R.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
 #include "sample.h"
 
-void cBaseecoZ(
+/*
+ * The Gibbs sampler of cBaseecoZ, drawing from stream (see rngUnif). With a
+ * stream other than NULL it can run off the main thread (see cBaseecoZCV): it
+ * then neither checks for interrupts nor calls error(), and verbose has to be 0.
+ * returns: 0, or the LAPACK error code of Sigma or its posterior scale failing
+ * to invert, which ends the draws
+ */
+static int ecoZGibbs(
 	      /*data input */
 	      double *pdX,     /* data (X, Y) */
 	      double *pdZ,     /* covariates Z */
-	      int *pinZp,      /* dimension of Z
-				  if =1, =gibbsBase
-			             =2 and Z=X, gibbsXBase
-			             >2 or Z!=X, regression*/
+	      int *pinZp,      /* number of covariates, i.e. columns of Z; the design
+				  of (W1*, W2*) is Z %x% diag(1,2), so that beta has
+				  2*pinZp elements, those of W1* and W2* alternating */
 	      int *pin_samp,   /* sample size */
 	      /*MCMC draws */
 	      int *n_gen,      /* number of gibbs draws */
@@ -60,7 +69,8 @@ void cBaseecoZ(
 	      /* storage for Gibbs draws of beta and Sigam, packed */
 	      double *pdSBeta, double *pdSSigma,
 	      /* storage for Gibbs draws of W*/
-	      double *pdSW1, double *pdSW2
+	      double *pdSW1, double *pdSW2,
+	      unsigned long long *stream
 	      ){	   
   
   int n_samp = *pin_samp; /* sample size */
@@ -70,7 +80,8 @@ void cBaseecoZ(
   int x0_samp = *sampx0;
   int t_samp = n_samp+s_samp+x1_samp+x0_samp;  /* total sample size */ 
   int n_dim = 2;          /* The dimension of the ecological table */
-  int n_cov = *pinZp;     /* The dimension of the covariates */
+  int n_zcov = *pinZp;    /* The number of covariates */
+  int n_cov = n_dim*n_zcov; /* The dimension of beta */
   int n_step = 1000;
   
   /* priors */
@@ -91,10 +102,13 @@ void cBaseecoZ(
   double **Wstar = doubleMatrix(t_samp, n_dim);
   double *Wstar_bar = doubleArray(n_dim);
 
-  /* The covariates and W */ 
-  double **Z = doubleMatrix(t_samp*n_dim+n_cov, n_cov+1);
-  /* Z*cholesky factor of covaraince matrix*/ 
-  double **Zstar = doubleMatrix(t_samp*n_dim+n_cov, n_cov+1);
+  /* The cross-products of the covariates pdZ (column-major) with
+     themselves and Wstar; with the design Z %x% I, all the sums over
+     areas reduce to these */ 
+  double *pdWstar = doubleArray(t_samp*n_dim); /* Wstar, column-major */
+  double **ZZ = doubleMatrix(n_zcov, n_zcov); /* Z'Z, fixed */
+  double **ZW = doubleMatrix(n_zcov, n_dim);  /* Z'Wstar */
+  double **WW = doubleMatrix(n_dim, n_dim);   /* Wstar'Wstar */
 
   /* grids */
   double **W1g = doubleMatrix(n_samp, n_step); /* grids for W1 */
@@ -104,6 +118,8 @@ void cBaseecoZ(
   /* paramters for Wstar under Normal baseline model */
   double *beta = doubleArray(n_cov); /* vector of regression coefficients */
   double **mu = doubleMatrix(t_samp, n_dim); 
+  double *pdB = doubleArray(n_cov);          /* beta as a n_zcov by n_dim matrix */
+  double *pdmu = doubleArray(t_samp*n_dim);  /* Z B, column-major */
   double **Sigma = doubleMatrix(n_dim, n_dim);
   double **InvSigma = doubleMatrix(n_dim, n_dim);
 
@@ -114,11 +130,13 @@ void cBaseecoZ(
   /* matrices used for sweep */
   /* quantities used in sweep */
   double **SS = doubleMatrix(n_cov+1, n_cov+1); /* the sum of square matrix */
-  double *epsilon = doubleArray(t_samp*n_dim);  /* The error term */
   double **R = doubleMatrix(n_dim, n_dim);      /* ee' */
+  double *A0beta0 = doubleArray(n_cov);         /* A0 beta0 */
+  double beta0A0beta0 = 0;                      /* beta0' A0 beta0 */
  
   /* misc variables */
-  int i, j, k, l, main_loop;   /* used for various loops */
+  int i, j, k, l, m, main_loop;   /* used for various loops */
+  int status, step;
   int itemp;
   int itempA=0; /* counter for alpha */
   int itempB=0; 
@@ -130,10 +148,6 @@ void cBaseecoZ(
   double *vtemp = doubleArray(n_dim);
   double **mtemp = doubleMatrix(n_dim, n_dim);
   double **mtemp1 = doubleMatrix(n_dim, n_dim);
-  double **mtemp2 = doubleMatrix(n_cov, n_cov);
-
-  /* get random seed */
-  GetRNGstate();
 
   /**read prior information*/
   itemp=0;
@@ -154,33 +168,21 @@ void cBaseecoZ(
     for (i = 0; i < n_samp; i++) 
       X[i][j] = pdX[itemp++];
   
-  /**read Z **/
-  for (i=0; i<t_samp*n_dim+n_cov; i++)
-    for(j=0; j<=n_cov;j++) {
-      Z[i][j]=0;
-      Zstar[i][j]=0;
-    }
-  itemp = 0;
-  for (k=0; k<n_cov; k++)
-    for (j=0; j<n_dim; j++)
-      for (i=0; i<t_samp; i++)
-	Z[j*t_samp+i][k]=pdZ[itemp++];
-  
-  /* add prior information to Z*/
-  dcholdc(A0, n_cov, mtemp2);  /*Cholesky decomopsition*/
+  /**Z'Z **/
+  crossProd(pdZ, t_samp, n_zcov, ZZ);
 
+  /* prior information */
   for (j=0; j<n_cov; j++) {
-    Zstar[t_samp*n_dim+j][n_cov]=beta0[j];
-    for (k=0; k<n_cov; k++){
-      Zstar[t_samp*n_dim+j][n_cov]+=mtemp2[j][k]*beta0[j];
-      Zstar[t_samp*n_dim+j][k]=mtemp2[j][k];
-    }
-  }      
+    A0beta0[j]=0;
+    for (k=0; k<n_cov; k++)
+      A0beta0[j]+=A0[j][k]*beta0[k];
+    beta0A0beta0+=beta0[j]*A0beta0[j];
+  }
     
   /* initialize W, Wstar for n_samp*/
   for (i=0; i< n_samp; i++) {
     if (X[i][1]!=0 && X[i][1]!=1) {
-      W[i][0]=runif(minW1[i], maxW1[i]);
+      W[i][0]=minW1[i]+(maxW1[i]-minW1[i])*rngUnif(stream);
       W[i][1]=(X[i][1]-X[i][0]*W[i][0])/(1-X[i][0]);
     }
     if (X[i][1]==0)
@@ -219,7 +221,6 @@ void cBaseecoZ(
 	S_Wstar[i][j]=log(S_W[i][j])-log(1-S_W[i][j]);
 	W[(n_samp+x1_samp+x0_samp+i)][j]=S_W[i][j];
 	Wstar[(n_samp+x1_samp+x0_samp+i)][j]=S_Wstar[i][j];
-	Z[(i+n_samp+x1_samp+x0_samp)*n_dim+j][n_cov]=Wstar[(i+n_samp+x1_samp+x0_samp)][j];
       }
   }
 
@@ -234,33 +235,31 @@ void cBaseecoZ(
   for(j=0;j<n_dim;j++)
     for(k=0;k<n_dim;k++)
       Sigma[j][k]=Sigmastart[itemp++];
-  dinv(Sigma, n_dim, InvSigma);
+  status=dinvInfo(Sigma, n_dim, InvSigma, &step);
 
   /***Gibbs for  normal prior ***/
-  for(main_loop=0; main_loop<*n_gen; main_loop++){
-    for (i=0; i<t_samp; i++)
-      for (j=0; j<n_dim; j++) 
-	mu[i][j]=0;
+  for(main_loop=0; main_loop<*n_gen && !status; main_loop++){
     /**update W, Wstar given mu, Sigma in regular areas**/
-    for (i=0;i<t_samp;i++)
+    for (k=0; k<n_zcov; k++)
       for (j=0; j<n_dim; j++)
-	for (k=0; k<n_cov; k++) 
-	  mu[i][j]+=Z[i*n_dim+j][k]*beta[k];
+	pdB[j*n_zcov+k]=beta[k*n_dim+j];
+    matrixMulCol(pdZ, pdB, t_samp, n_zcov, n_dim, pdmu);
+    for (i=0; i<t_samp; i++)
+      for (j=0; j<n_dim; j++) 
+	mu[i][j]=pdmu[j*t_samp+i];
     
     for (i=0; i<n_samp; i++) {
       if ( X[i][1]!=0 && X[i][1]!=1 ) {
 	/*1 project BVN(mu, Sigma) on the inth tomo line */
 	/*2 sample W_i on the ith tomo line */
 	if (*Grid)
-	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma, n_dim);
+	  rGrid(W[i], W1g[i], W2g[i], n_grid[i], mu[i], InvSigma, n_dim, stream);
 	else
-	  rMH(W[i], X[i], minW1[i], maxW1[i], mu[i], InvSigma, n_dim);
+	  rMH(W[i], X[i], minW1[i], maxW1[i], mu[i], InvSigma, n_dim, stream);
       } 
       /*3 compute Wsta_i from W_i*/
       Wstar[i][0]=log(W[i][0])-log(1-W[i][0]);
       Wstar[i][1]=log(W[i][1])-log(1-W[i][1]);
-      Z[i*n_dim][n_cov]=Wstar[i][0];
-      Z[i*n_dim+1][n_cov]=Wstar[i][1];
     }
     
     /*update W2 given W1, mu and Sigma in x1 homeogeneous areas */
@@ -268,12 +267,9 @@ void cBaseecoZ(
       for (i=0; i<x1_samp; i++) {
 	dtemp=mu[n_samp+i][1]+Sigma[0][1]/Sigma[0][0]*(Wstar[n_samp+i][0]-mu[n_samp+i][0]);
 	dtemp1=Sigma[1][1]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
-	Rprintf("\n%14g%14g\n", dtemp, dtemp1);
 	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+i][1]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+i][1]=dtemp+dtemp1*rngNorm(stream);
 	W[n_samp+i][1]=exp(Wstar[n_samp+i][1])/(1+exp(Wstar[n_samp+i][1]));
-	Z[(i+n_samp)*n_dim][n_cov]=Wstar[(i+n_samp)][0];
-	Z[(i+n_samp)*n_dim+1][n_cov]=Wstar[(i+n_samp)][1];
       }
 
     /*update W1 given W2, mu and Sigma in x0 homeogeneous areas */
@@ -282,34 +278,34 @@ void cBaseecoZ(
 	dtemp=mu[n_samp+x1_samp+i][0]+Sigma[0][1]/Sigma[1][1]*(Wstar[n_samp+x1_samp+i][1]-mu[n_samp+x1_samp+i][1]);
 	dtemp1=Sigma[0][0]*(1-Sigma[0][1]*Sigma[0][1]/(Sigma[0][0]*Sigma[1][1]));
 	dtemp1=sqrt(dtemp1);
-	Wstar[n_samp+x1_samp+i][0]=rnorm(dtemp, dtemp1);
+	Wstar[n_samp+x1_samp+i][0]=dtemp+dtemp1*rngNorm(stream);
 	W[n_samp+x1_samp+i][0]=exp(Wstar[n_samp+x1_samp+i][0])/(1+exp(Wstar[n_samp+x1_samp+i][0]));
-	Z[(i+n_samp+x1_samp)*n_dim][n_cov]=Wstar[(i+n_samp+x1_samp)][0];
-	Z[(i+n_samp+x1_samp)*n_dim+1][n_cov]=Wstar[(i+n_samp+x1_samp)][1];
       }
 
-    dcholdc(InvSigma, n_dim, mtemp);
-    for (i=0; i<t_samp*n_dim; i++)
-      for (j=0; j<=n_cov; j++)
-	Zstar[i][j]=0;
+    /* the cross-products of Z and Wstar */
     for (i=0; i<t_samp; i++)
-      for(j=0; j<n_dim; j++)
-	for(k=0; k<n_dim; k++)
-	  for(l=0; l<=n_cov; l++)
-	    Zstar[i*n_dim+k][l]+=mtemp[k][j]*Z[i*n_dim+j][l];
-
-    /*construct SS matrix for SWEEP */
-    for (j=0; j<=n_cov; j++)
-      for (k=0; k<=n_cov; k++)
-	SS[j][k]=0;
-    for(i=0; i<(t_samp*n_dim); i++)
-      for(k=0; k<=n_cov; k++)
-	for(l=0; l<=n_cov; l++)
-	  SS[k][l]+=Zstar[i][k]*Zstar[i][l];
-    for(j=0; j<n_cov; j++)
-      for(k=0; k<=n_cov; k++)
-	for(l=0; l<=n_cov; l++)
-	  SS[k][l]+=Zstar[n_samp*n_dim+j][k]*Zstar[n_samp*n_dim+j][l];
+      for (j=0; j<n_dim; j++)
+	pdWstar[j*t_samp+i]=Wstar[i][j];
+    crossProd2(pdZ, pdWstar, t_samp, n_zcov, n_dim, ZW);
+    crossProd(pdWstar, t_samp, n_dim, WW);
+
+    /*construct SS matrix for SWEEP: for the design Z %x% I, 
+      the sums over areas of Z'InvSigma Z and Z'InvSigma Wstar are 
+      Z'Z %x% InvSigma and (Z'Wstar InvSigma), plus the prior */
+    for (k=0; k<n_zcov; k++)
+      for (j=0; j<n_dim; j++) {
+	for (l=0; l<n_zcov; l++)
+	  for (m=0; m<n_dim; m++)
+	    SS[k*n_dim+j][l*n_dim+m]=ZZ[k][l]*InvSigma[j][m]+A0[k*n_dim+j][l*n_dim+m];
+	SS[k*n_dim+j][n_cov]=A0beta0[k*n_dim+j];
+	for (m=0; m<n_dim; m++)
+	  SS[k*n_dim+j][n_cov]+=ZW[k][m]*InvSigma[j][m];
+	SS[n_cov][k*n_dim+j]=SS[k*n_dim+j][n_cov];
+      }
+    SS[n_cov][n_cov]=beta0A0beta0;
+    for (j=0; j<n_dim; j++)
+      for (m=0; m<n_dim; m++)
+	SS[n_cov][n_cov]+=InvSigma[j][m]*WW[j][m];
 
     /*SWEEP to get posterior mean anf variance for beta */
     for (j=0; j<n_cov; j++) 
@@ -321,31 +317,28 @@ void cBaseecoZ(
       for (k=0; k<n_cov; k++)
 	Vbeta[j][k]=-SS[j][k];
     }
-    rMVN(beta, mbeta, Vbeta, n_cov);
-
-    /*draw Sigmar give beta and Wstar */
-    for(i=0; i<t_samp; i++)
-      for(j=0; j<n_dim; j++) {
-	epsilon[i*n_dim+j]=Z[i*n_dim+j][n_cov];
-	for (k=0;k<n_cov; k++)
-	  epsilon[i*n_dim+j]-=Z[i*n_dim+j][k]*beta[k];
-      }
+    rngMVN(beta, mbeta, Vbeta, n_cov, stream);
+
+    /*draw Sigmar give beta and Wstar: with B the n_zcov x n_dim matrix of beta, 
+      the residuals e=Wstar-ZB have e'e=W'W-B'Z'W-W'ZB+B'Z'ZB */
     for(j=0; j<n_dim; j++)
-      for(k=0; k<n_dim; k++) 
-	R[j][k]=0;
-    for (i=0; i<t_samp; i++)
-      for(j=0; j<n_dim; j++)
-	for(k=0; k<n_dim; k++) 
-	  R[j][k]+=epsilon[i*n_dim+j]*epsilon[i*n_dim+k];
+      for(m=0; m<n_dim; m++) {
+	R[j][m]=WW[j][m];
+	for (k=0; k<n_zcov; k++) {
+	  R[j][m]-=beta[k*n_dim+j]*ZW[k][m]+ZW[k][j]*beta[k*n_dim+m];
+	  for (l=0; l<n_zcov; l++)
+	    R[j][m]+=beta[k*n_dim+j]*ZZ[k][l]*beta[l*n_dim+m];
+	}
+      }
     for(j=0; j<n_dim; j++)
       for (k=0; k<n_dim; k++)
 	mtemp[j][k]=S0[j][k]+R[j][k];
-    dinv(mtemp, n_dim, mtemp1);
-    rWish(InvSigma, mtemp1, nu0+t_samp, n_dim);
-    dinv(InvSigma, n_dim, Sigma);
+    if ((status=dinvInfo(mtemp, n_dim, mtemp1, &step))) break;
+    rngWish(InvSigma, mtemp1, nu0+t_samp, n_dim, stream);
+    if ((status=dinvInfo(InvSigma, n_dim, Sigma, &step))) break;
     
     /*store Gibbs draw after burn-in and every nth draws */      
-    R_CheckUserInterrupt();
+    if (stream == NULL) R_CheckUserInterrupt();
     if (main_loop>=*burn_in){
       itempC++;
       if (itempC==nth){
@@ -370,39 +363,200 @@ void cBaseecoZ(
       }
   } /*end of MCMC for normal */ 
   
-  /** write out the random seed **/
-  PutRNGstate();
-
   /* Freeing the memory */
   FreeMatrix(X, n_samp);
   FreeMatrix(W, t_samp);
   FreeMatrix(Wstar, t_samp);
   FreeMatrix(S_W, s_samp);
   FreeMatrix(S_Wstar, s_samp);
-  Free(minW1);
-  Free(maxW1);
-  free(n_grid);
+  Free(n_grid);
   FreeMatrix(S0, n_dim);
   FreeMatrix(W1g, n_samp);
   FreeMatrix(W2g, n_samp);
   FreeMatrix(mu,t_samp);
   FreeMatrix(Sigma,n_dim);
   FreeMatrix(InvSigma, n_dim);
-  FreeMatrix(Z, t_samp*n_dim+n_cov);
-  FreeMatrix(Zstar, t_samp*n_dim+n_cov);
+  Free(pdWstar);
+  Free(pdB);
+  Free(pdmu);
+  FreeMatrix(ZZ, n_zcov);
+  FreeMatrix(ZW, n_zcov);
+  FreeMatrix(WW, n_dim);
   Free(Wstar_bar);
   Free(vtemp);
   FreeMatrix(mtemp, n_dim);
   FreeMatrix(mtemp1, n_dim);
-  FreeMatrix(mtemp2, n_cov);
   Free(beta);
   Free(beta0);
   FreeMatrix(A0, n_cov);
   FreeMatrix(SS, n_cov+1);
   Free(mbeta);
   FreeMatrix(Vbeta, n_cov);
-  Free(epsilon);
+  Free(A0beta0);
   FreeMatrix(R, n_dim);
-  
+  return status;
 } /* main */
 
+/* The Gibbs sampler of the normal regression model (see ecoZGibbs), on R's RNG */
+void cBaseecoZ(double *pdX, double *pdZ, int *pinZp, int *pin_samp,
+	       int *n_gen, int *burn_in, int *pinth, int *verbose,
+	       int *pinu0, double *pdS0, double *pdbeta0, double *pdA0,
+	       double *betastart, double *Sigmastart,
+	       int *survey, int *sur_samp, double *sur_W,
+	       int *x1, int *sampx1, double *x1_W1,
+	       int *x0, int *sampx0, double *x0_W2,
+	       double *minW1, double *maxW1, int *parameter, int *Grid,
+	       double *pdSBeta, double *pdSSigma, double *pdSW1, double *pdSW2)
+{
+  int status;
+
+  /* get random seed */
+  GetRNGstate();
+  status=ecoZGibbs(pdX, pdZ, pinZp, pin_samp, n_gen, burn_in, pinth, verbose,
+		   pinu0, pdS0, pdbeta0, pdA0, betastart, Sigmastart,
+		   survey, sur_samp, sur_W, x1, sampx1, x1_W1, x0, sampx0, x0_W2,
+		   minW1, maxW1, parameter, Grid, pdSBeta, pdSSigma, pdSW1, pdSW2, NULL);
+  /** write out the random seed **/
+  PutRNGstate();
+  if (status)
+    error("cBaseecoZ: Sigma is not positive definite. Error code %d\n", status);
+}
+
+
+
+/* 
+ * K-fold (or leave-group-out) cross-validation of the normal regression model:
+ * each fold is fitted by ecoZGibbs on the other areas, and its held-out areas are
+ * scored by the posterior mean squared error of Y, predicting W from the draws
+ * of beta and Sigma and the covariates of the area. The data and the covariates
+ * Z (n_samp x n_zcov, as in cBaseecoZ) are read only and shared by
+ * all the folds. The folds are fitted concurrently, each drawing from its own
+ * stream seeded from R's RNG (see rngSeed), so that the scores do not depend on
+ * the number of threads; a fold whose Sigma fails to invert is reported after
+ * all folds are done. Only areas with 0<X<1 are used.
+ */
+void cBaseecoZCV(
+		 double *pdX,     /* data (X, Y) */
+		 double *pdZ,     /* covariates Z */
+		 int *pinZp,      /* number of covariates */
+		 int *pin_samp,   /* sample size */
+		 int *fold,       /* fold of each area, 0..n_fold-1 */
+		 int *pin_fold,   /* number of folds */
+		 int *n_gen, int *burn_in, int *pinth, int *verbose,
+		 int *pinu0, double *pdS0, double *pdbeta0, double *pdA0,
+		 double *betastart, double *Sigmastart,
+		 double *minW1, double *maxW1,
+		 int *threads,    /* number of threads; 0 = OpenMP default */
+		 double *score    /* mean squared error of the held-out Y of each fold */
+		 ) {
+  int n_samp = *pin_samp, n_fold = *pin_fold, n_zcov = *pinZp, n_dim = 2;
+  int n_cov = n_dim*n_zcov;
+  int n_store = (*n_gen - *burn_in) / *pinth;
+  int f, i, n_test;
+
+  if (n_store < 1)
+    error("cBaseecoZCV: no draws are kept after burn-in and thinning");
+
+  unsigned long long *stream = Calloc(n_fold, unsigned long long);
+  int *status = Calloc(n_fold, int);
+
+  GetRNGstate();
+  for (f=0; f<n_fold; f++)
+    rngSeed(&stream[f]);
+  PutRNGstate();
+
+  if (*verbose)
+    for (f=0; f<n_fold; f++) {
+      n_test = 0;
+      for (i=0; i<n_samp; i++)
+	if (fold[i]==f) n_test++;
+      Rprintf("fold %d of %d: %d areas held out\n", f+1, n_fold, n_test);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(dynamic) num_threads(*threads>0 ? *threads : omp_get_max_threads())
+#endif
+  for (f=0; f<n_fold; f++) {
+    int j, k, m, n_train = 0, n_test;
+    int zero = 0, one = 1;
+    double dzero = 0, mu[2], s2[2], Yhat, dtemp;
+
+    /* the training areas, in the layout of cBaseecoZ */
+    for (i=0; i<n_samp; i++)
+      if (fold[i]!=f) n_train++;
+    n_test = n_samp-n_train;
+    status[f] = 0;
+    if (n_train==0 || n_test==0) {
+      score[f] = NA_REAL;
+      continue;
+    }
+    double *X = Calloc(n_dim*n_train, double);
+    double *Z = Calloc(n_train*n_zcov, double);
+    double *lW1 = Calloc(n_train, double);
+    double *uW1 = Calloc(n_train, double);
+    double *pdSBeta = Calloc(n_store*n_cov, double);
+    double *pdSSigma = Calloc(n_store*3, double);
+    double *pdSW1 = Calloc(n_store*n_train, double);
+    double *pdSW2 = Calloc(n_store*n_train, double);
+    m = 0;
+    for (i=0; i<n_samp; i++)
+      if (fold[i]!=f) {
+	X[m] = pdX[i];
+	X[n_train+m] = pdX[n_samp+i];
+	lW1[m] = minW1[i];
+	uW1[m] = maxW1[i];
+	for (k=0; k<n_zcov; k++)
+	  Z[k*n_train+m] = pdZ[k*n_samp+i];
+	m++;
+      }
+    status[f] = ecoZGibbs(X, Z, pinZp, &n_train, n_gen, burn_in, pinth, &zero,
+			  pinu0, pdS0, pdbeta0, pdA0, betastart, Sigmastart,
+			  &zero, &zero, &dzero, &zero, &zero, &dzero, &zero, &zero, &dzero,
+			  lW1, uW1, &one, &zero, pdSBeta, pdSSigma, pdSW1, pdSW2,
+			  &stream[f]);
+
+    /* E(W) from E(logit^-1(N(mu, s2))) ~ logit^-1(mu/sqrt(1+pi*s2/8)) */
+    score[f] = 0;
+    for (i=0; i<n_samp && !status[f]; i++)
+      if (fold[i]==f) {
+	Yhat = 0;
+	for (m=0; m<n_store; m++) {
+	  for (j=0; j<n_dim; j++) {
+	    mu[j] = 0;
+	    for (k=0; k<n_zcov; k++)
+	      mu[j] += pdZ[k*n_samp+i]*pdSBeta[m*n_cov+k*n_dim+j];
+	  }
+	  s2[0] = pdSSigma[m*3];
+	  s2[1] = pdSSigma[m*3+2];
+	  for (j=0; j<n_dim; j++) {
+	    dtemp = mu[j]/sqrt(1+M_PI*s2[j]/8);
+	    Yhat += (j==0 ? pdX[i] : 1-pdX[i])/(1+exp(-dtemp));
+	  }
+	}
+	Yhat /= n_store;
+	score[f] += (pdX[n_samp+i]-Yhat)*(pdX[n_samp+i]-Yhat);
+      }
+    score[f] /= n_test;
+
+    Free(X);
+    Free(Z);
+    Free(lW1);
+    Free(uW1);
+    Free(pdSBeta);
+    Free(pdSSigma);
+    Free(pdSW1);
+    Free(pdSW2);
+  }
+
+  /* the first failed fold */
+  int failed = -1, errorM = 0;
+  for (f=n_fold-1; f>=0; f--)
+    if (status[f]) {
+      failed = f;
+      errorM = status[f];
+    }
+  Free(stream);
+  Free(status);
+  if (failed>=0)
+    error("cBaseecoZCV: fold %d: Sigma is not positive definite. Error code %d\n", failed+1, errorM);
+}
@@ -6,27 +6,33 @@
 */
 
 /* .C calls */
-extern void cBase2C(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
-extern void cBaseeco(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cBase2C(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cBaseeco(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
 extern void cBaseecoX(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
 extern void cBaseecoZ(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
-extern void cBaseRC(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cBaseecoZCV(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cBaseRC(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
 extern void cDPeco(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
 extern void cDPecoX(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
-extern void cEMeco(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cEMeco(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cEMecoBatch(void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *);
+extern void cUniqueRows(void *, void *, void *, void *, void *);
 extern void preBaseX(void *, void *, void *, void *, void *, void *, void *);
 extern void preDP(void *, void *, void *, void *, void *, void *, void *);
 extern void preDPX(void *, void *, void *, void *, void *, void *, void *, void *);
 
 static const R_CMethodDef CEntries[] = {
-    {"cBase2C",   (DL_FUNC) &cBase2C,   22},
-    {"cBaseeco",  (DL_FUNC) &cBaseeco,  32},
+    {"cBase2C",   (DL_FUNC) &cBase2C,   23},
+    {"cBaseeco",  (DL_FUNC) &cBaseeco,  33},
     {"cBaseecoX", (DL_FUNC) &cBaseecoX, 36},
-    {"cBaseecoZ", (DL_FUNC) &cBaseecoZ, 29},
-    {"cBaseRC",   (DL_FUNC) &cBaseRC,   23},
+    {"cBaseecoZ", (DL_FUNC) &cBaseecoZ, 31},
+    {"cBaseecoZCV", (DL_FUNC) &cBaseecoZCV, 22},
+    {"cBaseRC",   (DL_FUNC) &cBaseRC,   24},
     {"cDPeco",    (DL_FUNC) &cDPeco,    36},
     {"cDPecoX",   (DL_FUNC) &cDPecoX,   40},
-    {"cEMeco",    (DL_FUNC) &cEMeco,    27},
+    {"cEMeco",    (DL_FUNC) &cEMeco,    39},
+    {"cEMecoBatch", (DL_FUNC) &cEMecoBatch, 23},
+    {"cUniqueRows", (DL_FUNC) &cUniqueRows, 5},
     {"preBaseX",  (DL_FUNC) &preBaseX,   7},
     {"preDP",     (DL_FUNC) &preDP,      7},
     {"preDPX",    (DL_FUNC) &preDPX,     8},
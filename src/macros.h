@@ -15,6 +15,28 @@
  enum e_datapoint_types {DPT_General,DPT_Homog_X1, DPT_Homog_X0, DPT_Survey};
  typedef enum e_datapoint_types datapoint_type;
 
+/* components of the fused E-step integrand (see SuffExpAll): the normalizing constant on the
+ * tomography line followed by the moments, in the same order as e_sufficient_stats
+ */
+ enum e_moments {MOM_NormC, MOM_W1star, MOM_W2star, MOM_W1star2, MOM_W1W2star, MOM_W2star2, MOM_W1, MOM_W2, MOM_Len};
+ typedef enum e_moments moment_index;
+
+/* largest number of components of a vector-valued line integrand: the missing information
+ * integrand (see InfoExpAll) has 1+p+p(p+1)/2 of them, with p=9 parameters under NCAR
+ */
+# define VEC_MaxLen 55
+
+/* tolerance of the line integrals; the E-step integrals start looser (see ecoIntTol) */
+# define INT_Tol 1e-11
+
+/* quadrature backend for the tomography-line integrals (see fintegrate.c) */
+ enum e_quad_types {QUAD_Adaptive, QUAD_GaussLegendre, QUAD_TanhSinh};
+ typedef enum e_quad_types quad_type;
+
+/* outcome of an EM fit run quietly, off the main thread (see ecoEMFit) */
+ enum e_fit_status {FIT_OK, FIT_SingularSigma, FIT_BadStart};
+ typedef enum e_fit_status fit_status;
+
 /* parameters and observed data  -- no longer used*/
 struct Param_old{
   double mu[2];
@@ -38,6 +60,52 @@ struct Param_old{
 
 typedef struct Param_old Param_old;
 
+/**
+ * A fixed-order quadrature rule on the tomography line parameter t,
+ * precomputed once per run. The rule carries its own error estimate:
+ * errWeight holds the difference between its weights and those of an embedded
+ * lower order rule (zero-extended to the same nodes)
+ */
+struct quadRule {
+  quad_type type;
+  int order; //number of Gauss-Legendre nodes, or tanh-sinh level (step size 2^-order)
+  int n; //number of nodes, including those only used by the error estimate
+  double* node; //nodes, already mapped to the integration interval
+  double* weight;
+  double* errWeight;
+};
+
+typedef struct quadRule quadRule;
+
+/**
+ * Tomography lines of the general (non-survey) areas, which depend only on X and Y.
+ * Computed once by readData, one array per field indexed by caseParam.id:
+ * W1(t)=W1lb+m1*t and W2(t)=W2ub+m2*t for t in [0,1]
+ */
+struct areaLines {
+  int n;
+  double *W1lb, *W1ub, *W2lb, *W2ub; //bounds of W1 and W2
+  double *m1, *m2; //slopes: W1ub-W1lb and W2lb-W2ub
+  int* degenerate; //1 if Y is so close to 0 or 1 that W1=W2=Y is used instead of the line integrals
+};
+
+typedef struct areaLines areaLines;
+
+/**
+ * Constants of the bivariate normal density of (W1*,W2*) that only change with Sigma,
+ * so that the integrands do not recompute them at every node (see setDensityConst)
+ */
+struct densityConst {
+  double rho; //correlation of W1* and W2*
+  double halfInvOneMinusRho2; //1/(2(1-rho^2))
+  double invS11, invS22; //1/s11, 1/s22
+  double invSd12; //1/sqrt(s11*s22)
+  double norm; //1/(2 pi sqrt(s11 s22 (1-rho^2)))
+  double logNorm;
+};
+
+typedef struct densityConst densityConst;
+
 /**
  * The structure that holds per-record infromation
  */
@@ -52,7 +120,12 @@ struct caseParam {
   double Wbounds[2][2];  //[i][j] is {j:lower,upper}-bound of W{i+1}
   int suff; //the sufficient stat we're calculating: 0->W1, 1->W2,2->W1^2,3->W1W2,4->W2^2,7->Log Lik, 5/6,-1 ->test case
   datapoint_type dataType;
+  double weight; //number of identical areas this record stands for (see cUniqueRows)
   double** Z_i; //CCAR: k x 2
+  int id; //position in the params array (indexes setP->lines)
+  int intErr; //ier of the last failed line integral, 0 if none; printed by the caller (see printIntegrationError)
+  int intErrSuff; //the statistic that failed, -1 for the fused E-step moments
+  double intErrResult[2]; //its value and error estimate
 };
 
 typedef struct caseParam caseParam;
@@ -62,6 +135,7 @@ typedef struct caseParam caseParam;
  */
 struct setParam {
   int n_samp, t_samp, s_samp,x1_samp,x0_samp,param_len,suffstat_len; //types of data sizes
+  double t_weight; //number of areas behind the t_samp records (see caseParam.weight)
   int iter, ncar, ccar, ccar_nvar, fixedRho, sem, hypTest, verbose, calcLoglik; //options
   int semDone[7]; //whether that row of the R matrix is done
   int varParam[9]; //whether the parameter is included in the R matrix
@@ -75,6 +149,16 @@ struct setParam {
   double** hypTestCoeff;
   double hypTestResult;
   double* pdTheta;
+  quadRule quad; //integration backend for the E-step
+  int threads; //number of OpenMP threads for the E-step, 0 = OpenMP default
+  int accel; //1 = SQUAREM acceleration of the EM iterations (see ecoSQUAREM)
+  int quiet; //1 = ecoEStep prints nothing and leaves integration errors in caseP (see ecoSEM)
+  int invErr, invErrStep; //while quiet: the first failed inversion of Sigma, 0 if none (see sigmaInv)
+  char* invErrMsg;
+  int historyEvery, historyRows; //EM history: record every k-th iteration, rows recorded (see setHistory)
+  double intTol; //tolerance of the E-step integrals, INT_Tol or looser (see ecoIntTol)
+  areaLines lines; //tomography lines of the first n_samp areas
+  densityConst dens; //refreshed by ecoEStep from the current Sigma
 };
 
 typedef struct setParam setParam;
@@ -92,5 +176,7 @@ typedef struct Param Param;
 
 //typedef void integr_fn(double *x, int n, void *ex); //is already defined in Applic.h
 typedef double gsl_fn(double x, void *ex);
+//vector-valued integrand: evaluates nf functions at each of the n points in x, out is n x nf (row major)
+typedef void vec_integr_fn(double *x, int n, double *out, int nf, void *ex);
 
 # endif
@@ -47,6 +47,26 @@ double dMVN(
 }
 
 
+/* the log density of Multivariate Normal distribution without its
+   normalising constant, for density ratios with the same SIG_INV */
+double dMVNkern(
+	double *Y,		/* The data */
+	double *MEAN,		/* The parameters */
+	double **SIG_INV,       /* inverse of the covariance matrix */
+	int dim)                /* dimension */
+{
+  int j,k;
+  double value=0.0;
+
+  for(j=0;j<dim;j++){
+    for(k=0;k<j;k++)
+      value+=2*(Y[k]-MEAN[k])*(Y[j]-MEAN[j])*SIG_INV[j][k];
+    value+=(Y[j]-MEAN[j])*(Y[j]-MEAN[j])*SIG_INV[j][j];
+  }
+  return(-0.5*value);
+}
+
+
 /* the density of Multivariate T-distribution */
 double dMVT(
             double *Y,          /* The data */
@@ -82,6 +102,17 @@ void rMVN(
 	  double *mean,           /* The vector of means */
 	  double **Var,           /* The matrix Variance */
 	  int size)               /* The dimension */
+{
+  rngMVN(Sample, mean, Var, size, NULL);
+}
+
+/* Sample from the MVN dist on a stream (see rngUnif) */
+void rngMVN(
+	    double *Sample,         /* Vector for the sample */
+	    double *mean,           /* The vector of means */
+	    double **Var,           /* The matrix Variance */
+	    int size,               /* The dimension */
+	    unsigned long long *stream)
 {
   int j,k;
   double **Model = doubleMatrix(size+1, size+1);
@@ -95,12 +126,12 @@ void rMVN(
     Model[j][0]=mean[j-1];
   }
   Model[0][0]=-1;
-  Sample[0]=(double)norm_rand()*sqrt(Model[1][1])+Model[0][1];
+  Sample[0]=rngNorm(stream)*sqrt(Model[1][1])+Model[0][1];
   for(j=2;j<=size;j++){
     SWP(Model,j-1,size+1);
     cond_mean=Model[j][0];
     for(k=1;k<j;k++) cond_mean+=Sample[k-1]*Model[j][k];
-    Sample[j-1]=(double)norm_rand()*sqrt(Model[j][j])+cond_mean;
+    Sample[j-1]=rngNorm(stream)*sqrt(Model[j][j])+cond_mean;
   }
 
   FreeMatrix(Model,size+1);
@@ -117,6 +148,17 @@ void rWish(
 	   double **S,             /* The parameter */
 	   int df,                 /* the degrees of freedom */
 	   int size)               /* The dimension */
+{
+  rngWish(Sample, S, df, size, NULL);
+}
+
+/* Sample from a wish dist on a stream (see rngUnif) */
+void rngWish(
+	     double **Sample,        /* The matrix with to hold the sample */
+	     double **S,             /* The parameter */
+	     int df,                 /* the degrees of freedom */
+	     int size,               /* The dimension */
+	     unsigned long long *stream)
 {
   int i,j,k;
   double *V = doubleArray(size);
@@ -126,10 +168,10 @@ void rWish(
   double **mtemp = doubleMatrix(size, size);
 
   for(i=0;i<size;i++) {
-    V[i]=rchisq((double) df-i-1);
+    V[i]=(stream == NULL) ? rchisq((double) df-i-1) : 2*rngGamma(0.5*(df-i-1), stream);
     B[i][i]=V[i];
     for(j=(i+1);j<size;j++)
-      N[i][j]=norm_rand();
+      N[i][j]=rngNorm(stream);
   }
 
   for(i=0;i<size;i++) {
@@ -187,6 +229,103 @@ void rDirich(
     Sample[j] /= dtemp;
 }
 
+/* Independent random number streams for draws made in parallel, where
+ * R's generator cannot be used. A stream is seeded from R's generator,
+ * so that its draws follow set.seed, and advanced by splitmix64. The
+ * NULL stream is R's generator itself. */
+void rngSeed(unsigned long long *stream)
+{
+  *stream = ((unsigned long long) (unif_rand()*4294967296.0) << 32) ^
+    (unsigned long long) (unif_rand()*4294967296.0);
+}
+
+double rngUnif(unsigned long long *stream)
+{
+  unsigned long long z;
+
+  if (stream == NULL)
+    return unif_rand();
+  z = (*stream += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return ((z >> 11) + 0.5) / 9007199254740992.0;
+}
+
+double rngNorm(unsigned long long *stream)
+{
+  if (stream == NULL)
+    return norm_rand();
+  return qnorm(rngUnif(stream), 0, 1, 1, 0);
+}
+
+/* Gamma(a, 1) draw, by Marsaglia and Tsang (2000) on a stream; a < 1
+ * is boosted by U^(1/a) */
+double rngGamma(double a, unsigned long long *stream)
+{
+  double d, c, x, v, u;
+
+  if (stream == NULL)
+    return rgamma(a, 1.0);
+  if (a < 1)
+    return rngGamma(a+1, stream)*pow(rngUnif(stream), 1/a);
+  d = a-1.0/3;
+  c = 1/sqrt(9*d);
+  for (;;) {
+    do {
+      x = rngNorm(stream);
+      v = 1+c*x;
+    } while (v <= 0);
+    v = v*v*v;
+    u = rngUnif(stream);
+    if (log(u) < 0.5*x*x+d-d*v+d*log(v))
+      return d*v;
+  }
+}
+
+/* Hit-and-run on the slice {U: sum(U) = 1, minU <= U <= maxU} of the
+ * simplex: moves U, which has to lie in the slice, by iter steps along
+ * uniformly random directions with sum zero. The steps leave the
+ * uniform distribution on the slice invariant and are symmetric, so
+ * the result can be used as a Metropolis proposal that never fails. */
+void rHitRun(
+	     double *U,     /* current point, overwritten */
+	     double *minU,  /* lower bounds */
+	     double *maxU,  /* upper bounds */
+	     double *d,     /* workspace of length size */
+	     int size,      /* The dimension */
+	     int iter,      /* number of steps */
+	     unsigned long long *stream) /* see rngUnif */
+{
+  int i, j;
+  double dtemp, tmin, tmax;
+
+  for (i=0; i<iter; i++) {
+    dtemp = 0;
+    for (j=0; j<size; j++) {
+      d[j] = rngNorm(stream);
+      dtemp += d[j];
+    }
+    tmin = R_NegInf; tmax = R_PosInf;
+    for (j=0; j<size; j++) {
+      d[j] -= dtemp/size;
+      if (d[j] > 0) {
+	tmin = fmax2(tmin, (minU[j]-U[j])/d[j]);
+	tmax = fmin2(tmax, (maxU[j]-U[j])/d[j]);
+      }
+      else if (d[j] < 0) {
+	tmin = fmax2(tmin, (maxU[j]-U[j])/d[j]);
+	tmax = fmin2(tmax, (minU[j]-U[j])/d[j]);
+      }
+    }
+    if (tmin < tmax) {
+      dtemp = tmin+(tmax-tmin)*rngUnif(stream);
+      for (j=0; j<size; j++)
+	U[j] = fmin2(maxU[j], fmax2(minU[j], U[j]+dtemp*d[j]));
+    }
+  }
+}
+
 /** density function on tomography line Y=XW_1+ (1-X)W_2
  * Note: asssumes that the two points given W1* and W2*
  * are on the tomography line
@@ -197,42 +336,20 @@ double dBVNtomo(double *Wstar,  /* Wstar values */
 		double normc)  //Normalization factor
 
 {
-  int dim=2;
-  double *MEAN=doubleArray(dim);
-  double **SIGMA=doubleMatrix(dim,dim);
-  double density;
-  double rho, dtemp;
-
+  double density,d0,d1;
   Param *param=(Param *)pp;
-  MEAN[0]=param->caseP.mu[0];
-  MEAN[1]=param->caseP.mu[1];
-  SIGMA[0][0]=param->setP->Sigma[0][0];
-  SIGMA[1][1]=param->setP->Sigma[1][1];
-  SIGMA[0][1]=param->setP->Sigma[0][1];
-  SIGMA[1][0]=param->setP->Sigma[1][0];
-
-
-  rho=SIGMA[0][1]/sqrt(SIGMA[0][0]*SIGMA[1][1]);
-  dtemp=1/(2*M_PI*sqrt(SIGMA[0][0]*SIGMA[1][1]*(1-rho*rho)));
+  densityConst* c=&(param->setP->dens); //set by setDensityConst
 
-
-  density=-1/(2*(1-rho*rho))*
-   ((Wstar[0]-MEAN[0])*(Wstar[0]-MEAN[0])/SIGMA[0][0]+
-    +(Wstar[1]-MEAN[1])*(Wstar[1]-MEAN[1])/SIGMA[1][1]
-    -2*rho*(Wstar[0]-MEAN[0])*(Wstar[1]-MEAN[1])/sqrt(SIGMA[0][0]*SIGMA[1][1]))
-   +log(dtemp)-log(normc);
+  d0=Wstar[0]-param->caseP.mu[0];
+  d1=Wstar[1]-param->caseP.mu[1];
+  density=-c->halfInvOneMinusRho2*
+   (d0*d0*c->invS11+d1*d1*c->invS22-2*c->rho*d0*d1*c->invSd12)
+   +c->logNorm-log(normc);
 
   if (give_log==0) density=exp(density);
-    /*Rprintf("s11 %5g s22 %5g normc %5g dtemp %5g ldensity %5g\n", SIGMA[0][0],SIGMA[1][1],normc, dtemp, density);
-    char ch;
-    scanf(" %c", &ch );*/
-
-  Free(MEAN);
-  FreeMatrix(SIGMA,dim);
 
   return density;
 
-
 }
 
 double invLogit(double x) {
@@ -6,10 +6,21 @@
 *******************************************************************/
 
 double dMVN(double *Y, double *MEAN, double **SIG_INV, int dim, int give_log);
+double dMVNkern(double *Y, double *MEAN, double **SIG_INV, int dim);
 double dMVT(double *Y, double *MEAN, double **SIG_INV, int nu, int dim, int give_log);
 void rMVN(double *Sample, double *mean, double **inv_Var, int size);
 void rWish(double **Sample, double **S, int df, int size);
+void rngMVN(double *Sample, double *mean, double **Var, int size,
+	    unsigned long long *stream);
+void rngWish(double **Sample, double **S, int df, int size,
+	     unsigned long long *stream);
 void rDirich(double *Sample, double *theta, int size);
+void rngSeed(unsigned long long *stream);
+double rngUnif(unsigned long long *stream);
+double rngNorm(unsigned long long *stream);
+double rngGamma(double a, unsigned long long *stream);
+void rHitRun(double *U, double *minU, double *maxU, double *d, int size, int iter,
+	     unsigned long long *stream);
 double dBVNtomo(double *Wstar, void* pp, int give_log, double normc);
 double invLogit(double x);
 double logit(double x,char* emsg);
@@ -14,6 +14,7 @@
 #include "vector.h"
 #include "subroutines.h"
 #include "rand.h"
+#include "sample.h"
 
 
 /* Grid method samping from tomography line*/
@@ -24,7 +25,8 @@ void rGrid(
 	   int ni_grid,            /* number of grids for observation i*/
 	   double *mu,             /* mean vector for normal */ 
 	   double **InvSigma,      /* Inverse covariance matrix for normal */
-	   int n_dim)              /* dimension of parameters */
+	   int n_dim,              /* dimension of parameters */
+	   unsigned long long *stream) /* see rngUnif */
 {
   int j;
   double dtemp;
@@ -47,7 +49,7 @@ void rGrid(
 
   /*2 sample W_i on the ith tomo line */
   j=0;
-  dtemp=unif_rand();
+  dtemp=rngUnif(stream);
   while (dtemp > prob_grid_cum[j]) j++;
   Sample[0]=W1gi[j];
   Sample[1]=W2gi[j];
@@ -117,7 +119,8 @@ void rMH(
 	 double W1max,           /* upper bound for W1 */
 	 double *mu,            /* mean vector for normal */ 
 	 double **InvSigma,     /* Inverse covariance matrix for normal */
-	 int n_dim)              /* dimension of parameters */
+	 int n_dim,              /* dimension of parameters */
+	 unsigned long long *stream) /* see rngUnif */
 {
   int j;
   double dens1, dens2, ratio;
@@ -126,7 +129,8 @@ void rMH(
   double *vtemp1 = doubleArray(n_dim);
   
   /* sample W_1 from unif(W1min, W1max) */
-  Sample[0] = runif(W1min, W1max);
+  Sample[0] = (stream == NULL) ? runif(W1min, W1max) :
+    W1min+(W1max-W1min)*rngUnif(stream);
   Sample[1] = XY[1]/(1-XY[0])-Sample[0]*XY[0]/(1-XY[0]);
   for (j = 0; j < n_dim; j++) {
     vtemp[j] = log(Sample[j])-log(1-Sample[j]);
@@ -141,7 +145,7 @@ void rMH(
   ratio = fmin2(1, exp(dens1-dens2));
   
   /* accept */
-  if (unif_rand() < ratio) 
+  if (rngUnif(stream) < ratio) 
     for (j=0; j<n_dim; j++) 
       W[j]=Sample[j];
   
@@ -151,8 +155,9 @@ void rMH(
 }
 
 
-/* sample W via MH for 2xC table */
-void rMH2c(
+/* sample W via MH for 2xC table; returns 1 if the rejection sampling
+   failed and hit-and-run was used instead, 0 otherwise */
+int rMH2c(
 	   double *W,              /* W */
 	   double *X,              /* X_i */
 	   double Y,               /* Y_i */
@@ -163,18 +168,28 @@ void rMH2c(
 	   int n_dim,              /* dimension of parameters */
 	   int maxit,              /* max number of iterations for
 				      rejection sampling */
-	   int reject)             /* if 1, use rejection sampling to
+	   int reject,             /* if 1, use rejection sampling to
 				      draw from the truncated Dirichlet
 				      if 0, use Gibbs sampling
 				   */  
+	   int *inner,             /* number of Gibbs iterations */
+	   double *innerStat)      /* running sums for the lag-1
+				      autocorrelation of the Gibbs
+				      iterations of this area: their
+				      number, then the sum, the sum of
+				      squares and the lag-1 cross
+				      product of each coordinate
+				      (1+3*n_dim); if not NULL, inner
+				      is adapted */
 {
-  int iter = 100;   /* number of Gibbs iterations */
-  int i, j, exceed;
+  int i, j, l, exceed, hitrun = 0;
+  double rho, rhoMax, var;
   double dens1, dens2, ratio, dtemp;
   double *Sample = doubleArray(n_dim);
   double *param = doubleArray(n_dim);
   double *vtemp = doubleArray(n_dim);
   double *vtemp1 = doubleArray(n_dim);
+  double *prev = doubleArray(n_dim);
   
   /* set parent Dirichlet parameter to 1 */
   for (j = 0; j < n_dim; j++)
@@ -183,29 +198,61 @@ void rMH2c(
   /* Sample a candidate draw of W from truncated Dirichlet */
   if (reject) { /* rejection sampling */
     i = 0; exceed = 1;
-    while (exceed > 0) {
+    while (exceed > 0 && i < maxit) {
       rDirich(vtemp, param, n_dim);
       exceed = 0;
       for (j = 0; j < n_dim; j++) 
 	if (vtemp[j] > maxU[j] || vtemp[j] < minU[j])
 	  exceed++;
       i++;
-      if (i > maxit)
-	error("rMH2c: rejection algorithm failed because bounds are too tight.\n increase maxit or use gibbs sampler instead.");
+    }
+    if (exceed > 0) { /* bounds too tight: hit-and-run from W instead */
+      for (j = 0; j < n_dim; j++) 
+	vtemp[j] = W[j]*X[j]/Y;
+      rHitRun(vtemp, minU, maxU, vtemp1, n_dim, n_dim, NULL);
+      hitrun = 1;
     }
   }
-  else { /* gibbs sampler */
+  else { /* gibbs sampler started from W: each step draws a random
+	    coordinate and the last one uniformly given the others, so
+	    the proposal is symmetric whatever the number of iterations */
     for (j = 0; j < n_dim; j++) 
       vtemp[j] = W[j]*X[j]/Y;
-    for (i = 0; i < iter; i++) {
-      dtemp = vtemp[n_dim-1];
-      for (j = 0; j < n_dim-1; j++) {
-	dtemp += vtemp[j];
+    for (i = 0; i < *inner; i++) {
+      for (j = 0; j < n_dim; j++)
+	prev[j] = vtemp[j];
+      for (l = 0; l < n_dim-1; l++) {
+	j = (int) (unif_rand()*(n_dim-1));
+	dtemp = vtemp[j]+vtemp[n_dim-1];
 	vtemp[j] = runif(fmax2(minU[j], dtemp-maxU[n_dim-1]), 
 			 fmin2(maxU[j], dtemp-minU[n_dim-1]));
-	dtemp -= vtemp[j];
+	vtemp[n_dim-1] = dtemp-vtemp[j];
       }
-      vtemp[n_dim-1] = dtemp;
+      if (innerStat) {
+	innerStat[0] += 1;
+	for (j = 0; j < n_dim; j++) {
+	  innerStat[1+3*j] += vtemp[j];
+	  innerStat[2+3*j] += vtemp[j]*vtemp[j];
+	  innerStat[3+3*j] += vtemp[j]*prev[j];
+	}
+      }
+    }
+    /* run just long enough for the proposal to decorrelate from W
+       in its slowest coordinate */
+    if (innerStat && innerStat[0] >= INNER_MinObs) {
+      rhoMax = 0;
+      for (j = 0; j < n_dim; j++) {
+	dtemp = innerStat[1+3*j]/innerStat[0];
+	var = innerStat[2+3*j]/innerStat[0]-dtemp*dtemp;
+	rho = var > 0 ? (innerStat[3+3*j]/innerStat[0]-dtemp*dtemp)/var : 0;
+	rhoMax = fmax2(rhoMax, rho);
+      }
+      if (rhoMax <= INNER_Cor)
+	*inner = 1;
+      else if (rhoMax >= 1)
+	*inner = INNER_MaxIter;
+      else
+	*inner = imin2(INNER_MaxIter, (int) ceil(log(INNER_Cor)/log(rhoMax)));
     }
   }
   /* calcualte W and its logit transformation */
@@ -215,9 +262,9 @@ void rMH2c(
     vtemp1[j] = log(W[j])-log(1-W[j]);
   }
   
-  /* acceptance ratio */
-  dens1 = dMVN(vtemp, mu, InvSigma, n_dim, 1);
-  dens2 = dMVN(vtemp1, mu, InvSigma, n_dim, 1);
+  /* acceptance ratio; the normalising constants cancel */
+  dens1 = dMVNkern(vtemp, mu, InvSigma, n_dim);
+  dens2 = dMVNkern(vtemp1, mu, InvSigma, n_dim);
   for (j=0; j<n_dim; j++) {
     dens1 -= (log(Sample[j])+log(1-Sample[j]));
     dens2 -= (log(W[j])+log(1-W[j]));
@@ -233,6 +280,8 @@ void rMH2c(
   Free(param);
   Free(vtemp);
   Free(vtemp1);
+  Free(prev);
+  return hitrun;
 }
 
 
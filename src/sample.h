@@ -5,12 +5,22 @@
   Copyright: GPL version 2 or later.
 *******************************************************************/
 
+/* the inner Gibbs sampler of rMH2c runs at most INNER_MaxIter
+   iterations, and is adapted after INNER_MinObs of them to the number
+   at which the largest lag-1 autocorrelation of its coordinates decays
+   below INNER_Cor */
+# define INNER_MaxIter 100
+# define INNER_MinObs 20
+# define INNER_Cor 0.05
+
 void rGrid(double *Sample, double *W1gi, double *W2gi, int ni_grid, 
-	   double *mu, double **InvSigma, int n_dim); 
+	   double *mu, double **InvSigma, int n_dim,
+	   unsigned long long *stream); 
 void GridPrep(double **W1g, double **W2g, double **X, double *maxW1,
 	      double *minW1, int *n_grid, int n_samp, int n_step);
 void rMH(double *W, double *XY, double W1min, double W1max, 
-	 double *mu, double **InvSigma, int n_dim);
-void rMH2c(double *W, double *X, double Y, double *minU, 
+	 double *mu, double **InvSigma, int n_dim,
+	 unsigned long long *stream);
+int rMH2c(double *W, double *X, double Y, double *minU, 
 	   double *maxU, double *mu, double **InvSigma, int n_dim, 
-	   int maxit, int reject);
+	   int maxit, int reject, int *inner, double *innerStat);
@@ -12,6 +12,7 @@
 #include <Rmath.h>
 #include <R.h>
 #include <R_ext/Lapack.h>
+#include <R_ext/BLAS.h>
 #include "vector.h"
 #include "rand.h"
 #include "subroutines.h"
@@ -34,20 +35,103 @@ double dotProduct(double* a, double* b, int size) {
  */
 void matrixMul(double** A, double** B, int r1, int c1, int r2, int c2, double** C) {
   int i,j,k;
-  double tmp[r1][c2];
-  if (c1!=r2) error("Matrix multiplication: %d != %d", c2, r1);
-  else {
+  double *tmp, *pdA, *pdB;
+  if (c1!=r2) error("Matrix multiplication: %d != %d", c1, r2);
+  if ((double)r1*c1*c2 < BLAS_MinFlops) {
+    /* small products (most calls) stay on the stack; C may be A or B */
+    double stmp[r1][c2];
     for (i=0; i<r1; i++)
       for (j=0; j<c2; j++) {
         double entry=0;
         for(k=0;k<r2;k++) entry += A[i][k]*B[k][j];
-        tmp[i][j]=entry;
+        stmp[i][j]=entry;
       }
     for (i=0; i<r1; i++)
-      for (j=0; j<c2; j++) {
-        C[i][j]=tmp[i][j];
+      for (j=0; j<c2; j++)
+        C[i][j]=stmp[i][j];
+  }
+  else {
+    tmp = doubleArray(r1*c2);
+    pdA = doubleArray(r1*c1);
+    pdB = doubleArray(r2*c2);
+    for (i=0; i<r1; i++)
+      for (k=0; k<c1; k++) pdA[k*r1+i]=A[i][k];
+    for (k=0; k<r2; k++)
+      for (j=0; j<c2; j++) pdB[j*r2+k]=B[k][j];
+    matrixMulCol(pdA, pdB, r1, c1, c2, tmp);
+    Free(pdA);
+    Free(pdB);
+    /* C may be A or B */
+    for (i=0; i<r1; i++)
+      for (j=0; j<c2; j++)
+        C[i][j]=tmp[j*r1+i];
+    Free(tmp);
+  }
+}
+
+/*
+ * The product C = A B of column-major matrices, A is r1 by c1 and
+ * B is c1 by c2
+ */
+void matrixMulCol(double *A, double *B, int r1, int c1, int c2, double *C) {
+  int i,j,k;
+  double one = 1, zero = 0;
+  if ((double)r1*c1*c2 < BLAS_MinFlops) {
+    for (j=0; j<c2; j++) {
+      for (i=0; i<r1; i++) C[j*r1+i]=0;
+      for (k=0; k<c1; k++)
+        for (i=0; i<r1; i++) C[j*r1+i]+=A[k*r1+i]*B[j*c1+k];
+    }
+  }
+  else
+    F77_CALL(dgemm)("N", "N", &r1, &c2, &c1, &one, A, &r1, B, &c1, &zero, C, &r1);
+}
+
+/*
+ * The cross-product X'X of the column-major n by p matrix X
+ */
+void crossProd(double *X, int n, int p, double **XX) {
+  int i,j,k;
+  double one = 1, zero = 0, *pdXX;
+  if ((double)n*p*p < BLAS_MinFlops) {
+    for (j=0; j<p; j++)
+      for (k=j; k<p; k++) {
+        XX[j][k]=0;
+        for (i=0; i<n; i++) XX[j][k]+=X[j*n+i]*X[k*n+i];
+      }
+  }
+  else {
+    pdXX = doubleArray(p*p);
+    F77_CALL(dsyrk)("U", "T", &p, &n, &one, X, &n, &zero, pdXX, &p);
+    for (j=0; j<p; j++)
+      for (k=j; k<p; k++) XX[j][k]=pdXX[k*p+j];
+    Free(pdXX);
+  }
+  for (j=0; j<p; j++)
+    for (k=0; k<j; k++) XX[j][k]=XX[k][j];
+}
+
+/*
+ * The cross-product X'Y of the column-major n by p and n by q
+ * matrices X and Y
+ */
+void crossProd2(double *X, double *Y, int n, int p, int q, double **XY) {
+  int i,j,k;
+  double one = 1, zero = 0, *pdXY;
+  if ((double)n*p*q < BLAS_MinFlops) {
+    for (j=0; j<p; j++)
+      for (k=0; k<q; k++) {
+        XY[j][k]=0;
+        for (i=0; i<n; i++) XY[j][k]+=X[j*n+i]*Y[k*n+i];
       }
   }
+  else {
+    pdXY = doubleArray(p*q);
+    F77_CALL(dgemm)("T", "N", &p, &q, &n, &one, X, &n, Y, &n, &zero, pdXY, &p);
+    for (j=0; j<p; j++)
+      for (k=0; k<q; k++) XY[j][k]=pdXY[k*p+j];
+    Free(pdXY);
+  }
 }
 
 /*  The Sweep operator */
@@ -80,40 +164,58 @@ void dinv(double **X,
 	  int	size,
 	  double **X_inv)
 {
-  int i,j, k, errorM;
-  double *pdInv = doubleArray(size*size);
+  int step, errorM;
 
-  for (i = 0, j = 0; j < size; j++)
-    for (k = 0; k <= j; k++)
-      pdInv[i++] = X[k][j];
-  F77_CALL(dpptrf)("U", &size, pdInv, &errorM);
-  if (!errorM) {
-    F77_CALL(dpptri)("U", &size, pdInv, &errorM);
-    if (errorM) {
+  errorM=dinvInfo(X,size,X_inv,&step);
+  if (errorM) {
+    if (step==2) {
       if (errorM>0) {
         Rprintf("The matrix being inverted is singular. Error code %d\n", errorM);
       } else {
         Rprintf("The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
       }
-      error("Exiting from dinv().\n");
     }
-  }
-  else {
-    if (errorM>0) {
-      Rprintf("The matrix being inverted was not positive definite. Error code %d\n", errorM);
-    } else {
-      Rprintf("The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
+    else {
+      if (errorM>0) {
+        Rprintf("The matrix being inverted was not positive definite. Error code %d\n", errorM);
+      } else {
+        Rprintf("The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
+      }
     }
     error("Exiting from dinv().\n");
   }
-  for (i = 0, j = 0; j < size; j++) {
-    for (k = 0; k <= j; k++) {
-      X_inv[j][k] = pdInv[i];
-      X_inv[k][j] = pdInv[i++];
-    }
+}
+
+/*
+ * dinv without printing or error(), so that it can be called off the main thread:
+ * returns 0 on success, otherwise the LAPACK error code, with step 1 if the
+ * Cholesky factorization (dpptrf) failed and 2 if the inversion (dpptri) did;
+ * X_inv is then left as it was
+ */
+int dinvInfo(double **X, int size, double **X_inv, int *step)
+{
+  int i,j, k, errorM;
+  double *pdInv = doubleArray(size*size);
+
+  for (i = 0, j = 0; j < size; j++)
+    for (k = 0; k <= j; k++)
+      pdInv[i++] = X[k][j];
+  *step=1;
+  F77_CALL(dpptrf)("U", &size, pdInv, &errorM);
+  if (!errorM) {
+    *step=2;
+    F77_CALL(dpptri)("U", &size, pdInv, &errorM);
   }
+  if (!errorM)
+    for (i = 0, j = 0; j < size; j++) {
+      for (k = 0; k <= j; k++) {
+	X_inv[j][k] = pdInv[i];
+	X_inv[k][j] = pdInv[i++];
+      }
+    }
 
   Free(pdInv);
+  return errorM;
 }
 
 /* inverting a matrix, first tyring positive definite trick, and then symmetric
@@ -124,61 +226,71 @@ void dinv2D(double* X,
 	  int	size,
 	  double* X_inv,char* emsg)
 {
-  int i,j, k, errorM, skip;
-  double *pdInv = doubleArray(size*size);
-  skip=0;
+  int step, errorM;
+  errorM=dinv2Dinfo(X,size,X_inv,&step);
+  if (errorM) dinv2DFail(errorM,step,emsg);
+}
+
+/* inverting a positive definite matrix as dinv2D, but without stopping:
+ * returns 0 on success, otherwise the LAPACK error code, with step 1 if the
+ * Cholesky factorization failed and 2 if the inversion from it did (see dinv2DFail).
+ * X_inv is left as it was on failure. Neither allocates nor prints, so it may be
+ * called off the main thread
+ */
+int dinv2Dinfo(double* X,
+	  int	size,
+	  double* X_inv, int* step)
+{
+  int i,j, k, errorM;
+  double pdInv[size*(size+1)/2];
 
   for (i = 0, j = 0; j < size; j++)
     for (k = 0; k <= j; k++)
       //pdInv[i++] = X[k][j];
       pdInv[i++] = *(X+k*size+j);
 
-//Rprintf("test: %5g %5g %d",pdInv[0],pdInv[(size == 3) ? 5 : 2],i);
+  *step=1;
   F77_CALL(dpptrf)("U", &size, pdInv, &errorM);
-  if (!errorM) {
-    F77_CALL(dpptri)("U", &size, pdInv, &errorM);
-    if (errorM) {
-      Rprintf(emsg);
-    if (errorM>0) {
-      Rprintf(": The matrix being inverted is singular. Error code %d\n", errorM);
-    } else {
-      Rprintf(": The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
-    }
-      error("Exiting from dinv2D().\n");
-    }
-  }
-  else {
-    Rprintf(emsg);
-    if (errorM>0) {
-      /* The matrix is not positive definite.
-       * This error does occur with proper data, when the likelihood curve is flat,
-       * usually with the combination of NCAR and SEM.  At one point we tried
-       * inverting the matrix via an alternative method that does not rely on
-       * positive definiteness (see below), but that just led to further errors.
-       * Instead, the program halts as gracefully as possible.
-       */
-      //Inverting the matrix anyway:
-      //Rprintf(": Warning, the matrix being inverted was not positive definite on minor order %d.\n", errorM);
-      //dinv2D_sym(X,size,X_inv,emsg);
-      //skip=1;
-      Rprintf(": Error, the matrix being inverted was not positive definite on minor order %d.\n", errorM);
-      error("The program cannot continue; try a different model or including supplemental data.\n");
-    } else {
-      Rprintf(": The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
-      error("Exiting from dinv2D().\n");
-    }
-  }
+  if (errorM) return errorM;
+  *step=2;
+  F77_CALL(dpptri)("U", &size, pdInv, &errorM);
+  if (errorM) return errorM;
 
-  if (skip==0) {
   for (i = 0, j = 0; j < size; j++) {
     for (k = 0; k <= j; k++) {
       *(X_inv+size*j+k) = pdInv[i];
       *(X_inv+size*k+j) = pdInv[i++];
     }
   }
-  }
+  return 0;
+}
 
-  Free(pdInv);
+/* stops with the message of a failed dinv2Dinfo */
+void dinv2DFail(int errorM, int step, char* emsg)
+{
+  Rprintf(emsg);
+  if (step==2) {
+    if (errorM>0) {
+      Rprintf(": The matrix being inverted is singular. Error code %d\n", errorM);
+    } else {
+      Rprintf(": The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
+    }
+    error("Exiting from dinv2D().\n");
+  }
+  if (errorM>0) {
+    /* The matrix is not positive definite.
+     * This error does occur with proper data, when the likelihood curve is flat,
+     * usually with the combination of NCAR and SEM.  At one point we tried
+     * inverting the matrix via an alternative method that does not rely on
+     * positive definiteness (see dinv2D_sym), but that just led to further errors.
+     * Instead, the program halts as gracefully as possible.
+     */
+    Rprintf(": Error, the matrix being inverted was not positive definite on minor order %d.\n", errorM);
+    error("The program cannot continue; try a different model or including supplemental data.\n");
+  } else {
+    Rprintf(": The matrix being inverted contained an illegal value. Error code %d.\n", errorM);
+    error("Exiting from dinv2D().\n");
+  }
 }
 
 
@@ -364,6 +476,57 @@ void dcholdc2D(double *X, int size, double *L)
   Free(pdTemp);
 }
 
+/* a row being grouped by cUniqueRows: its values, carried along for the qsort comparison */
+typedef struct {
+  const double *row; //ncol values, contiguous
+  int ncol;
+  int i; //position in the original matrix
+} uniqueKey;
+
+static int uniqueRowCompare(const uniqueKey *a, const uniqueKey *b) {
+  int k;
+  for (k=0; k<a->ncol; k++) {
+    if (a->row[k]<b->row[k]) return -1;
+    if (a->row[k]>b->row[k]) return 1;
+  }
+  return 0;
+}
+
+static int uniqueCompare(const void *a, const void *b) {
+  const uniqueKey *ka=(const uniqueKey*)a, *kb=(const uniqueKey*)b;
+  int c=uniqueRowCompare(ka,kb);
+  return c ? c : ka->i-kb->i; //equal rows keep their original order
+}
+
+/*
+ * Groups identical rows of an n x ncol matrix (by columns, as R stores it).
+ * Rows are sorted lexicographically and runs of equal rows collapsed.
+ * Keeps no state outside the call, so it may be called from several threads at once
+ * mutates: map[i] is the group of row i (1..nUnique, numbered by first appearance),
+ *          nUnique is the number of distinct rows
+ */
+void cUniqueRows(double *pdX, int *n, int *ncol, int *map, int *nUnique) {
+  uniqueKey *key=Calloc(*n,uniqueKey);
+  double *rows=doubleArray(*n * *ncol); //pdX by rows
+  int *lead=intArray(*n); //first row of the run of each row
+  int i,k;
+  for (i=0; i<*n; i++) {
+    for (k=0; k<*ncol; k++) rows[i * *ncol+k]=pdX[k * *n+i];
+    key[i].row=rows+i * *ncol;
+    key[i].ncol=*ncol;
+    key[i].i=i;
+  }
+  qsort(key,*n,sizeof(uniqueKey),uniqueCompare);
+  for (i=0; i<*n; i++)
+    lead[key[i].i]=(i>0 && uniqueRowCompare(&key[i-1],&key[i])==0) ? lead[key[i-1].i] : key[i].i;
+  *nUnique=0;
+  for (i=0; i<*n; i++)
+    map[i]=(lead[i]==i) ? ++(*nUnique) : map[lead[i]];
+  Free(key);
+  Free(rows);
+  free(lead);
+}
+
 int main () {
   Rprintf("hello world");
   return 0;
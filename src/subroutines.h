@@ -5,12 +5,23 @@
   Copyright: GPL version 2 or later.
 *******************************************************************/
 
+/* matrix products with fewer multiplications than this use the plain
+   loops, larger ones go to the BLAS */
+# define BLAS_MinFlops 20000
+
 void SWP( double **X, int k, int size);
 void dinv(double **X, int size, double **X_inv);
+int dinvInfo(double **X, int size, double **X_inv, int *step);
 void dinv2D(double *X, int size, double *X_inv,char* emsg);
+int dinv2Dinfo(double *X, int size, double *X_inv, int *step);
+void dinv2DFail(int errorM, int step, char* emsg);
 void dinv2D_sym(double *X, int size, double *X_inv,char* emsg);
 void dcholdc(double **X, int size, double **L);
 double ddet(double **X, int size, int give_log);
 double ddet2D(double **X, int size, int give_log);
 void dcholdc2D(double *X, int size, double *L);
 void matrixMul(double **A, double **B, int r1, int c1, int r2, int c2, double **C);
+void matrixMulCol(double *A, double *B, int r1, int c1, int c2, double *C);
+void crossProd(double *X, int n, int p, double **XX);
+void crossProd2(double *X, double *Y, int n, int p, int q, double **XY);
+void cUniqueRows(double *pdX, int *n, int *ncol, int *map, int *nUnique);